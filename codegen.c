@@ -3,27 +3,30 @@
 #include "parser.h"
 
 /* Options */
-FILE *bfin;
 FILE *bfout;
 int compile_output = 0;
 int dynamic_mem = 1;
 int mem_grow_rate = 2;
 int mem_size = 30000;
 int check_bounds = 0;
+int guard_mem = 0;
+long guard_cells = 0;
 int dump_core = 0;
 int bfbignum = 0;
 int optimize_c = 0;
 int optimize = 1;
 int pass_comments = 0;
 int bfthreads = 0;
+int cell_bits = 8;
+int flush_mode = FLUSH_STDIO;
 
 /* Code strings */
 char *bfstr_type = "unsigned char";
 char *bfstr_htype = NULL;
 char *bfstr_ptr = "ptr";
 char *bfstr_buffer = "bf_buffer";
-char *bfstr_get = "*%s = (BFTYPE) getchar ();\n";
-char *bfstr_put = "putchar ((char) *%s);\n";
+char *bfstr_get = "*%s = (BFTYPE) bf_getc ();\n";
+char *bfstr_put = "bf_putc ((char) *%s);\n";
 char *bfstr_loop = "while (*%s) {\n";
 char *bfstr_end = "}\n";
 char *bfstr_indent = "  ";
@@ -32,13 +35,75 @@ char *bfstr_name = "brainfuck";
 char *bfstr_memerr = "out of memory";
 char *bfstr_bounderr = "pointer out of bounds";
 
+/* Most bytes written by one literal bf_write () */
+#define LITERAL_MAX 4096
+
 int indent = 1;
+int lineno = 0;
+
+static int thread_cnt = 0;	/* Thread functions emitted */
+
+/* Most outputs gathered into bf_obuf */
+#define OBUF_SIZE 64
+
+/* Cells known to be inside the buffer, from ptr + reach_lo to
+   ptr + reach_hi. The buffer never shrinks, so they stay inside until
+   the pointer moves by an unknown amount. */
+static int reach_lo = 0, reach_hi = 0;
+
+/* Known reach at the entry of each open loop. Balanced loops, whose
+   body ends where it started, leave it as it was. */
+typedef struct reach_t
+{
+  int lo, hi;
+  int balanced;
+} reach_t;
+
+static reach_t *reach_stack = NULL;
+static int reach_depth = 0;
+static int reach_size = 0;
+
+/* Code before this index already has its buffer growth done */
+static int region_end = 0;
+
+static void reach_enter (ir_t * ir, int i);
+static void reach_leave ();
+
+static int obuf_left = 0;	/* Outputs left to gather */
+static int obuf_used = 0;	/* Outputs gathered */
+
+/* Count the outputs of unknown cells from i up to the next input,
+   loop boundary, constant output or comment, at most OBUF_SIZE. */
+static int out_group (ir_t * ir, int i)
+{
+  int n = 0, c;
+  for (c = 0; c < ir->com_count && ir->com[c].inst <= i; c++);
+  for (; i < ir->count && n < OBUF_SIZE; i++)
+    {
+      if (c < ir->com_count && ir->com[c].inst == i && n > 0)
+	break;
+      int inst = ir->inst[i];
+      if (inst == IM_IN || inst == IM_LOOP || inst == IM_END
+	  || inst == IM_SCAN || inst == IM_COUT)
+	break;
+      if (inst == IM_OUT)
+	n++;
+    }
+  return n;
+}
+
+/* Walk through intermediate code and generate code. */
+void im_codegen (ir_t * ir)
+{
+  codegen_begin ();
+  codegen_region (ir);
+  codegen_end ();
+}
 
-/* Walk through intermediate tree and generate code. */
-void im_codegen (inst_t * head)
+/* Start a program body. */
+void codegen_begin ()
 {
   /* Handle threads */
-  static int thread_cnt = 0;
   if (bfthreads)
     {
       fprintf (bfout, "void *bf%d (void *x) {\n", thread_cnt);
@@ -47,78 +112,124 @@ void im_codegen (inst_t * head)
     }
 
   indent = 1;
+}
 
-  int returned = 0;
-
-  inst_t *inst = head;
-  while (inst != NULL)
+/* Generate code for a piece of a program body. */
+void codegen_region (ir_t * ir)
+{
+  int i, c = 0;
+  region_end = 0;
+  for (i = 0; i < ir->count; i++)
     {
-      lineno = inst->lineno;
-      if (inst->comment && pass_comments)
+      lineno = ir->lineno[i];
+      if (c < ir->com_count && ir->com[c].inst == i)
 	{
-	  fprintf (bfout, "/*\n %s \n*/\n", inst->comment);
+	  fprintf (bfout, "/*\n %.*s \n*/\n", ir->com[c].len,
+		   ir->com_text + ir->com[c].off);
+	  c++;
 	}
 
-      switch (inst->inst * !returned)
+      /* Entering straight-line code */
+      if ((i == 0 || ir->inst[i - 1] == IM_LOOP
+	   || ir->inst[i - 1] == IM_END || ir->inst[i - 1] == IM_SCAN)
+	  && ir->inst[i] != IM_LOOP && ir->inst[i] != IM_END
+	  && ir->inst[i] != IM_SCAN)
+	print_block (ir, i);
+
+      switch (ir->inst[i])
 	{
 	case IM_CINC:		/* Cell increment */
-	  print_incdec ('+', inst->src);
+	  print_incdec ('+', ir->src[i], ir->dst[i]);
 	  break;
 
 	case IM_CDEC:		/* Cell decrement */
-	  print_incdec ('-', inst->src);
+	  print_incdec ('-', ir->src[i], ir->dst[i]);
 	  break;
 
 	case IM_PRGHT:		/* Move pointer right */
-	  print_move ('>', inst->src);
+	  print_move ('>', ir->src[i]);
 	  break;
 
 	case IM_PLEFT:		/* Move pointer left */
-	  print_move ('<', inst->src);
+	  print_move ('<', ir->src[i]);
 	  break;
 
 	case IM_IN:		/* Input */
-	  print_input ();
+	  print_input (ir->dst[i]);
 	  break;
 
 	case IM_OUT:		/* Output */
-	  print_output ();
+	  if (obuf_left == 0 && !bfthreads)
+	    obuf_left = out_group (ir, i);
+	  if (obuf_left > 1 || obuf_used > 0)
+	    print_output_buf (ir->dst[i]);
+	  else
+	    {
+	      obuf_left = 0;
+	      print_output (ir->dst[i]);
+	    }
+	  break;
+
+	case IM_COUT:		/* Constant output */
+	  {
+	    /* Write a run of constant output at once. */
+	    char text[LITERAL_MAX];
+	    size_t n = 0;
+	    for (;; i++)
+	      {
+		text[n++] = ir->val[i];
+		if (n == LITERAL_MAX || i + 1 == ir->count
+		    || ir->inst[i + 1] != IM_COUT
+		    || (c < ir->com_count && ir->com[c].inst == i + 1))
+		  break;
+	      }
+	    print_literal (text, n);
+	  }
 	  break;
 
 	case IM_CADD:		/* Cell copy */
-	  print_ccpy (inst->dst, inst->src);
+	  print_ccpy (ir->dst[i], ir->src[i], 1);
+	  break;
+
+	case IM_CMUL:		/* Cell multiply */
+	  print_ccpy (ir->dst[i], ir->src[i], ir->val[i]);
+	  break;
+
+	case IM_CPROD:		/* Cell product */
+	  print_cprod (ir->dst[i], ir->src[i], ir->src2[i], ir->val[i]);
 	  break;
 
 	case IM_CCLR:		/* Cell clear */
-	  print_cclr ();
+	  print_cclr (ir->dst[i]);
 	  break;
-	}
 
-      /* Select next instruction. First from loop, then from next,
-         then from ret. */
-      if (inst->loop && !returned)
-	{
+	case IM_LOOP:		/* Loop beginning */
+	  reach_enter (ir, i);
 	  print_loop ();
-	  inst = inst->loop;
-	  returned = 0;
 	  indent++;
-	}
-      else if (inst->next)
-	{
-	  inst = inst->next;
-	  returned = 0;
-	}
-      else if (inst->ret)
-	{
+	  break;
+
+	case IM_END:		/* Loop ending */
 	  print_end ();
-	  inst = inst->ret;
-	  returned = 1;
 	  indent--;
+	  reach_leave ();
+	  break;
+
+	case IM_CSET:		/* Cell set */
+	  print_cset (ir->dst[i], ir->val[i]);
+	  break;
+
+	case IM_SCAN:		/* Scan for zero */
+	  print_scan (ir->src[i]);
+	  reach_lo = reach_hi = 0;
+	  break;
 	}
-      else
-	inst = NULL;
     }
+}
 
+/* Finish a program body. */
+void codegen_end ()
+{
   if (bfthreads)
     {
       fprintf (bfout, "\n");
@@ -127,19 +238,157 @@ void im_codegen (inst_t * head)
     }
 }
 
-/* Print the top of the C file */
-void print_head ()
+/* Print the headers the generated code needs */
+static void print_includes ()
 {
+  if (!bfthreads && !bfbignum)
+    fprintf (bfout, "#define _GNU_SOURCE\n");
   fprintf (bfout, "#include <stdio.h>\n");
   fprintf (bfout, "#include <stdlib.h>\n");
   fprintf (bfout, "#include <string.h>\n");
-  if (dump_core)
+  if (dump_core || guard_mem)
     fprintf (bfout, "#include <signal.h>\n");
   if (bfbignum)
     fprintf (bfout, "#include <gmp.h>\n");
   if (bfthreads)
     fprintf (bfout, "#include <pthread.h>\n");
+  if (flush_mode != FLUSH_STDIO || guard_mem)
+    fprintf (bfout, "#include <unistd.h>\n" "#include <sys/mman.h>\n");
+  if (flush_mode != FLUSH_STDIO)
+    fprintf (bfout, "#include <sys/stat.h>\n");
+  if (!bfthreads && !bfbignum)
+    fprintf (bfout, "#ifdef __SSE2__\n"
+	     "#include <emmintrin.h>\n" "#endif\n");
   fprintf (bfout, "\n");
+}
+
+/* Print the memory resize function */
+static void print_buffinc ()
+{
+  fprintf (bfout, "/* Resize memory */\n");
+  fprintf (bfout, "void bf_buffinc (BFTYPE **ptr, int need) {\n");
+  if (bfthreads)
+    {
+      fprintf (bfout, "  pthread_mutex_lock (&mem_lock);\n");
+      fprintf (bfout, "  int offsets[%d];\n", bfthreads);
+      int i;
+      for (i = 0; i < bfthreads; i++)
+	fprintf (bfout, "  offsets[%d] = hptr[%d] - %s;\n",
+		 i, i, bfstr_buffer);
+    }
+  fprintf (bfout, "  int offset = *ptr - %s;\n\n", bfstr_buffer);
+  fprintf (bfout, "  int old_bsize = %s;\n", bfstr_bsize);
+  fprintf (bfout, "  while (offset + need >= %s)\n", bfstr_bsize);
+  fprintf (bfout, "    %s *= %d;\n\n", bfstr_bsize, mem_grow_rate);
+
+  fprintf (bfout, "  %s = (BFTYPE *) realloc ((void *) %s, "
+	   "%s * sizeof (BFTYPE));\n",
+	   bfstr_buffer, bfstr_buffer, bfstr_bsize);
+  fprintf (bfout, "  if (!%s) {\n", bfstr_buffer);
+  fprintf (bfout, "    fprintf (stderr, \"%s:%d:%s\\n\");\n",
+	   bfstr_name, lineno, bfstr_memerr);
+  fprintf (bfout, "    abort ();\n  }\n\n");
+
+  /* clear */
+  if (bfbignum && !bfthreads)
+    {
+      fprintf (bfout, "  bignum_init ((%s + old_bsize), "
+	       "%s - old_bsize);\n", bfstr_buffer, bfstr_bsize);
+      fprintf (bfout, "  *ptr = %s + offset;\n", bfstr_buffer);
+    }
+  else if (bfthreads)
+    {
+      fprintf (bfout, "  mutex_init ((%s + old_bsize), "
+	       "%s - old_bsize);\n", bfstr_buffer, bfstr_bsize);
+      int i;
+      for (i = 0; i < bfthreads; i++)
+	fprintf (bfout, "  hptr[%d] = %s + offsets[%d];\n",
+		 i, bfstr_buffer, i);
+      fprintf (bfout, "  pthread_mutex_unlock (&mem_lock);\n");
+    }
+  else
+    {
+      fprintf (bfout, "  memset ((%s + old_bsize), 0, "
+	       "(%s - old_bsize) * sizeof (BFTYPE));\n",
+	       bfstr_buffer, bfstr_bsize);
+      fprintf (bfout, "  *ptr = %s + offset;\n", bfstr_buffer);
+    }
+  fprintf (bfout, "}\n\n");
+}
+
+/* Print the guard page tape. A large range is reserved with the
+   origin in the middle, so the pointer can go either way, and the
+   kernel commits pages as they are first touched. The tape never
+   moves and nothing is checked as the pointer moves: running off
+   either end faults on a guard, which is reported as a bounds
+   error. */
+void print_guard ()
+{
+  fprintf (bfout,
+	   "/* Bytes inaccessible past each end of the tape */\n"
+	   "#define BF_GUARD ((size_t) 1 << 30)\n\n");
+  if (guard_cells > 0)
+    fprintf (bfout, "#define BF_HALF (%ldul * sizeof (BFTYPE))\n\n",
+	     guard_cells);
+  else
+    fprintf (bfout, "#define BF_HALF ((size_t) 1 << 34)\n\n");
+  fprintf (bfout,
+	   "BFTYPE *%s; /* Origin */\n"
+	   "BFTYPE *bf_tape_lo, *bf_tape_hi; /* Ends */\n"
+	   "static char *bf_map;\n"
+	   "static size_t bf_maplen;\n\n", bfstr_buffer);
+
+  fprintf (bfout,
+	   "/* Report a fault on a guard. Others crash as usual. */\n"
+	   "static void bf_segv (int sig, siginfo_t *si, void *uc) {\n"
+	   "  char *a = (char *) si->si_addr;\n"
+	   "  if (a >= bf_map && a < bf_map + bf_maplen) {\n"
+	   "    static const char msg[] = \"%s:%s\\n\";\n"
+	   "    ssize_t n = write (2, msg, sizeof (msg) - 1);\n"
+	   "    (void) n;\n"
+	   "    abort ();\n"
+	   "  }\n"
+	   "  signal (sig, SIG_DFL);\n"
+	   "}\n\n", bfstr_name, bfstr_bounderr);
+
+  fprintf (bfout,
+	   "/* Reserve the tape, as much as the address space allows up to "
+	   "BF_HALF\n"
+	   "   bytes each side of the origin */\n"
+	   "void bf_tape (void) {\n"
+	   "  size_t half;\n"
+	   "  for (half = BF_HALF;; half /= 2) {\n"
+	   "    half = (half + 4095) & ~(size_t) 4095;\n"
+	   "    bf_maplen = 2 * (BF_GUARD + half);\n"
+	   "    bf_map = mmap (NULL, bf_maplen, PROT_NONE, MAP_PRIVATE | "
+	   "MAP_ANONYMOUS\n"
+	   "                   | MAP_NORESERVE, -1, 0);\n"
+	   "    if (bf_map != MAP_FAILED) {\n"
+	   "      if (mprotect (bf_map + BF_GUARD, 2 * half, "
+	   "PROT_READ | PROT_WRITE) == 0)\n"
+	   "        break;\n"
+	   "      munmap (bf_map, bf_maplen);\n"
+	   "    }\n"
+	   "    if (half <= ((size_t) 1 << 20)) {\n"
+	   "      fprintf (stderr, \"%s:%d:%s\\n\");\n"
+	   "      abort ();\n"
+	   "    }\n"
+	   "  }\n"
+	   "  bf_tape_lo = (BFTYPE *) (bf_map + BF_GUARD);\n"
+	   "  bf_tape_hi = (BFTYPE *) (bf_map + BF_GUARD + 2 * half);\n"
+	   "  %s = bf_tape_lo + half / sizeof (BFTYPE);\n\n"
+	   "  struct sigaction sa;\n"
+	   "  memset (&sa, 0, sizeof (sa));\n"
+	   "  sa.sa_sigaction = bf_segv;\n"
+	   "  sa.sa_flags = SA_SIGINFO;\n"
+	   "  sigaction (SIGSEGV, &sa, NULL);\n"
+	   "}\n\n", bfstr_name, lineno, bfstr_memerr, bfstr_buffer);
+}
+
+/* Print the top of the C file */
+void print_head ()
+{
+  print_includes ();
 
   /* Type define */
   fprintf (bfout, "#define BFTYPE %s\n\n", bfstr_type);
@@ -157,19 +406,30 @@ void print_head ()
 
   /* resize prototype */
   if (dynamic_mem)
-    fprintf (bfout, "void bf_buffinc (BFTYPE **ptr);\n\n");
+    fprintf (bfout, "void bf_buffinc (BFTYPE **ptr, int need);\n\n");
+
+  /* I/O and output gathering */
+  print_io (flush_mode);
+  if (!bfthreads)
+    fprintf (bfout, "char bf_obuf[%d];\n\n", OBUF_SIZE);
 
   /* Main memory */
   char *bfinit = " = { 0 }";
   if (bfbignum)
     bfinit = "";
-  if (dynamic_mem)
+  if (guard_mem)
+    print_guard ();
+  else if (dynamic_mem)
     fprintf (bfout, "BFTYPE *%s;\n\n", bfstr_buffer);
   else
     fprintf (bfout, "BFTYPE %s[%d]%s;\n\n", bfstr_buffer, mem_size, bfinit);
   if (bfthreads && dynamic_mem)
     fprintf (bfout, "pthread_mutex_t mem_lock;\n\n");
 
+  /* The pointer starts at the start of the buffer */
+  reach_lo = 0;
+  reach_hi = mem_size - 1;
+
   /* Track buffer size */
   if (dynamic_mem || check_bounds || dump_core)
     fprintf (bfout, "int %s = %d; /* Buffer size */\n\n",
@@ -189,6 +449,8 @@ void print_head ()
       fprintf (bfout, "  for (i = 0; i < n; i++)\n");
       fprintf (bfout, "    mpz_init (buff[i]%s);\n", thread_str);
       fprintf (bfout, "}\n\n");
+      if (!bfthreads)
+	fprintf (bfout, "mpz_t bf_prod; /* Product scratch */\n\n");
     }
 
   /* mutex */
@@ -311,7 +573,7 @@ void print_head ()
       fprintf (bfout, "}\n\n");
 
       /* set */
-      fprintf (bfout, "void cell_set (int i, char in) {\n");
+      fprintf (bfout, "void cell_set (int i, long in) {\n");
       if (dynamic_mem)
 	{
 	  fprintf (bfout, "  pthread_mutex_lock (&mem_lock);\n");
@@ -353,7 +615,7 @@ void print_head ()
       else
 	fprintf (bfout, "  pthread_mutex_unlock (&ptr->lock);\n");
       fprintf (bfout, "  if (oob)\n");
-      fprintf (bfout, "    bf_buffinc (&%s);\n", bfstr_ptr);
+      fprintf (bfout, "    bf_buffinc (&%s, 0);\n", bfstr_ptr);
       fprintf (bfout, "}\n\n");
 
     }
@@ -410,59 +672,13 @@ void print_head ()
       fprintf (bfout, "}\n\n");
     }
 
+  /* Scan loops */
+  if (!bfthreads && !bfbignum)
+    print_scan_funcs ();
+
   if (dynamic_mem)
     {
-      /* Print memory resize function */
-      fprintf (bfout, "/* Resize memory */\n");
-      fprintf (bfout, "void bf_buffinc (BFTYPE **ptr) {\n");
-      if (bfthreads)
-	{
-	  fprintf (bfout, "  pthread_mutex_lock (&mem_lock);\n");
-	  fprintf (bfout, "  int offsets[%d];\n", bfthreads);
-	  int i;
-	  for (i = 0; i < bfthreads; i++)
-	    fprintf (bfout, "  offsets[%d] = hptr[%d] - %s;\n",
-		     i, i, bfstr_buffer);
-	}
-      fprintf (bfout, "  int offset = *ptr - %s;\n\n", bfstr_buffer);
-      fprintf (bfout, "  int old_bsize = %s;\n", bfstr_bsize);
-      fprintf (bfout, "  %s *= %d;\n", bfstr_bsize, mem_grow_rate);
-      fprintf (bfout, "  if (offset > %s)\n", bfstr_bsize);
-      fprintf (bfout, "    %s = offset;\n\n", bfstr_bsize);
-
-      fprintf (bfout, "  %s = (BFTYPE *) realloc ((void *) %s, "
-	       "%s * sizeof (BFTYPE));\n",
-	       bfstr_buffer, bfstr_buffer, bfstr_bsize);
-      fprintf (bfout, "  if (!%s) {\n", bfstr_buffer);
-      fprintf (bfout, "    fprintf (stderr, \"%s:%d:%s\\n\");\n",
-	       bfstr_name, lineno, bfstr_memerr);
-      fprintf (bfout, "    abort ();\n  }\n\n");
-
-      /* clear */
-      if (bfbignum && !bfthreads)
-	{
-	  fprintf (bfout, "  bignum_init ((%s + old_bsize), "
-		   "%s - old_bsize);\n", bfstr_buffer, bfstr_bsize);
-	  fprintf (bfout, "  *ptr = %s + offset;\n", bfstr_buffer);
-	}
-      else if (bfthreads)
-	{
-	  fprintf (bfout, "  mutex_init ((%s + old_bsize), "
-		   "%s - old_bsize);\n", bfstr_buffer, bfstr_bsize);
-	  int i;
-	  for (i = 0; i < bfthreads; i++)
-	    fprintf (bfout, "  hptr[%d] = %s + offsets[%d];\n",
-		     i, bfstr_buffer, i);
-	  fprintf (bfout, "  pthread_mutex_unlock (&mem_lock);\n");
-	}
-      else
-	{
-	  fprintf (bfout, "  memset ((%s + old_bsize), 0, "
-		   "(%s - old_bsize) * sizeof (BFTYPE));\n",
-		   bfstr_buffer, bfstr_bsize);
-	  fprintf (bfout, "  *ptr = %s + offset;\n", bfstr_buffer);
-	}
-      fprintf (bfout, "}\n\n");
+      print_buffinc ();
 
       /* main */
       fprintf (bfout, "int main () {\n");
@@ -475,15 +691,20 @@ void print_head ()
     {
       /* main */
       fprintf (bfout, "int main () {\n");
+      if (guard_mem)
+	fprintf (bfout, "  bf_tape ();\n");
       if (!bfthreads)
 	fprintf (bfout, "  BFTYPE *%s = %s;\n\n", bfstr_ptr, bfstr_buffer);
     }
 
   if (bfbignum && !bfthreads)
     {
-      fprintf (bfout, "  bignum_init (%s, %d);\n\n", bfstr_buffer, mem_size);
+      fprintf (bfout, "  bignum_init (%s, %d);\n", bfstr_buffer, mem_size);
+      fprintf (bfout, "  mpz_init (bf_prod);\n\n");
     }
 
+  if (flush_mode != FLUSH_STDIO)
+    fprintf (bfout, "  atexit (bf_flush);\n\n");
   if (dump_core)
     fprintf (bfout, "  signal (SIGINT, int_handle);\n\n");
 
@@ -519,6 +740,181 @@ void print_head ()
     }
 }
 
+/* Print the zero cell search functions used by scan loops. Byte
+   cells are searched with memchr ()/memrchr () at stride 1, and 16 at
+   a time with SSE2 at strides up to 16. */
+void print_scan_funcs ()
+{
+  fprintf (bfout,
+	   "/* Find the first zero cell at p, p + n, ... below end. "
+	   "Returns the first\n"
+	   "   position at or past end if there is none. */\n"
+	   "static BFTYPE *bf_scan_right (BFTYPE *p, BFTYPE *end, int n) {\n"
+	   "  if (p >= end)\n"
+	   "    return p;\n"
+	   "  if (sizeof (BFTYPE) == 1 && n == 1) {\n"
+	   "    BFTYPE *z = memchr (p, 0, end - p);\n"
+	   "    return z ? z : end;\n"
+	   "  }\n"
+	   "#ifdef __SSE2__\n"
+	   "  if (sizeof (BFTYPE) == 1 && n <= 16) {\n"
+	   "    int k, step = 16 / n * n;\n"
+	   "    unsigned mask = 0;\n"
+	   "    for (k = 0; k < step; k += n)\n"
+	   "      mask |= 1u << k;\n"
+	   "    while (end - p >= 16) {\n"
+	   "      __m128i v = _mm_loadu_si128 ((__m128i *) p);\n"
+	   "      unsigned z = _mm_movemask_epi8 (_mm_cmpeq_epi8 "
+	   "(v, _mm_setzero_si128 ())) & mask;\n"
+	   "      if (z)\n"
+	   "        return p + __builtin_ctz (z);\n"
+	   "      p += step;\n"
+	   "    }\n"
+	   "  }\n"
+	   "#endif\n"
+	   "  while (p < end && *p)\n"
+	   "    p += n;\n"
+	   "  return p;\n"
+	   "}\n\n");
+  fprintf (bfout,
+	   "/* Find the first zero cell at p, p - n, ... from begin up. "
+	   "Returns the first\n"
+	   "   position below begin if there is none. */\n"
+	   "static BFTYPE *bf_scan_left (BFTYPE *p, BFTYPE *begin, int n) {\n"
+	   "  if (p < begin)\n"
+	   "    return p;\n"
+	   "#ifdef __GLIBC__\n"
+	   "  if (sizeof (BFTYPE) == 1 && n == 1) {\n"
+	   "    BFTYPE *z = memrchr (begin, 0, p + 1 - begin);\n"
+	   "    return z ? z : begin - 1;\n"
+	   "  }\n"
+	   "#endif\n"
+	   "#ifdef __SSE2__\n"
+	   "  if (sizeof (BFTYPE) == 1 && n <= 16) {\n"
+	   "    int k, step = 16 / n * n;\n"
+	   "    unsigned mask = 0;\n"
+	   "    for (k = 0; k < step; k += n)\n"
+	   "      mask |= 0x8000u >> k;\n"
+	   "    while (p - begin >= 15) {\n"
+	   "      __m128i v = _mm_loadu_si128 ((__m128i *) (p - 15));\n"
+	   "      unsigned z = _mm_movemask_epi8 (_mm_cmpeq_epi8 "
+	   "(v, _mm_setzero_si128 ())) & mask;\n"
+	   "      if (z)\n"
+	   "        return p - 15 + (31 - __builtin_clz (z));\n"
+	   "      p -= step;\n"
+	   "    }\n"
+	   "  }\n"
+	   "#endif\n"
+	   "  while (p >= begin && *p)\n"
+	   "    p -= n;\n"
+	   "  return p;\n"
+	   "}\n\n");
+}
+
+/* Print the I/O runtime for a flush policy. Without threads stdio
+   is used unlocked. Threads share one lock around their own
+   buffers. */
+void print_io (int mode)
+{
+  char *lock = "", *unlock = "";
+  if (mode == FLUSH_STDIO)
+    {
+      char *u = bfthreads ? "" : "_unlocked";
+      fprintf (bfout, "#define bf_getc() getchar%s ()\n", u);
+      fprintf (bfout, "#define bf_putc(c) putchar%s (c)\n", u);
+      fprintf (bfout, "#define bf_write(s, n) fwrite (s, 1, n, stdout)\n\n");
+      return;
+    }
+  if (bfthreads)
+    {
+      fprintf (bfout, "pthread_mutex_t bf_iolock = "
+	       "PTHREAD_MUTEX_INITIALIZER;\n\n");
+      lock = "  pthread_mutex_lock (&bf_iolock);\n";
+      unlock = "  pthread_mutex_unlock (&bf_iolock);\n";
+    }
+
+  fprintf (bfout,
+	   "/* I/O buffers */\n"
+	   "#define BF_IOBUF 65536\n"
+	   "char bf_out[BF_IOBUF];\n"
+	   "static size_t bf_outn;\n"
+	   "unsigned char bf_inbuf[BF_IOBUF];\n"
+	   "static unsigned char *bf_in = bf_inbuf;\n"
+	   "static size_t bf_inpos, bf_inlen;\n\n");
+
+  fprintf (bfout,
+	   "/* Write out buffered output */\n"
+	   "void bf_flush (void) {\n"
+	   "  size_t i = 0;\n"
+	   "  while (i < bf_outn) {\n"
+	   "    ssize_t n = write (1, bf_out + i, bf_outn - i);\n"
+	   "    if (n <= 0)\n"
+	   "      break;\n"
+	   "    i += n;\n"
+	   "  }\n"
+	   "  bf_outn = 0;\n"
+	   "}\n\n");
+
+  fprintf (bfout, "void bf_write (const char *s, size_t n) {\n%s", lock);
+  fprintf (bfout,
+	   "  if (bf_outn + n > BF_IOBUF)\n"
+	   "    bf_flush ();\n"
+	   "  memcpy (bf_out + bf_outn, s, n);\n"
+	   "  bf_outn += n;\n");
+  if (mode != FLUSH_NONE)
+    fprintf (bfout, "  if (memchr (s, '\\n', n))\n" "    bf_flush ();\n");
+  fprintf (bfout, "%s}\n\n", unlock);
+
+  fprintf (bfout, "static inline void bf_putc (char c) {\n%s", lock);
+  fprintf (bfout, "  bf_out[bf_outn++] = c;\n");
+  if (mode == FLUSH_NONE)
+    fprintf (bfout, "  if (bf_outn == BF_IOBUF)\n");
+  else
+    fprintf (bfout, "  if (bf_outn == BF_IOBUF || c == '\\n')\n");
+  fprintf (bfout, "    bf_flush ();\n%s}\n\n", unlock);
+
+  fprintf (bfout,
+	   "/* Refill the input buffer, 0 at the end of input. Input from a "
+	   "regular file\n"
+	   "   is mapped and read in place, the rest of it at once. */\n"
+	   "int bf_fill (void) {\n"
+	   "  static int mapped = 0;\n"
+	   "  struct stat st;\n");
+  if (mode == FLUSH_INTERACTIVE)
+    fprintf (bfout, "  bf_flush ();\n");
+  fprintf (bfout,
+	   "  if (bf_in != bf_inbuf) {\n"
+	   "    munmap (bf_in, bf_inlen);\n"
+	   "    bf_in = bf_inbuf;\n"
+	   "  }\n"
+	   "  else if (!mapped && fstat (0, &st) == 0 "
+	   "&& S_ISREG (st.st_mode)) {\n"
+	   "    off_t at = lseek (0, 0, SEEK_CUR);\n"
+	   "    void *m = MAP_FAILED;\n"
+	   "    if (at >= 0 && st.st_size > at)\n"
+	   "      m = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);\n"
+	   "    mapped = 1;\n"
+	   "    if (m != MAP_FAILED) {\n"
+	   "      madvise (m, st.st_size, MADV_SEQUENTIAL);\n"
+	   "      lseek (0, st.st_size, SEEK_SET);\n"
+	   "      bf_in = (unsigned char *) m;\n"
+	   "      bf_inpos = at;\n"
+	   "      bf_inlen = st.st_size;\n"
+	   "      return 1;\n"
+	   "    }\n"
+	   "  }\n"
+	   "  ssize_t n = read (0, bf_in, BF_IOBUF);\n"
+	   "  bf_inpos = 0;\n"
+	   "  bf_inlen = n > 0 ? n : 0;\n"
+	   "  return bf_inlen > 0;\n" "}\n\n");
+
+  fprintf (bfout, "static inline int bf_getc (void) {\n%s", lock);
+  fprintf (bfout,
+	   "  int c = EOF;\n"
+	   "  if (bf_inpos < bf_inlen || bf_fill ())\n"
+	   "    c = bf_in[bf_inpos++];\n" "%s" "  return c;\n" "}\n\n", unlock);
+}
+
 /* Print the bottom of the C file */
 void print_tail ()
 {
@@ -537,8 +933,36 @@ void print_tail ()
   fprintf (bfout, "}\n");
 }
 
+/* Print a C file holding just the loop ir, for tiered execution. The
+   function name (ptr) runs it on the buffer that the caller stores in
+   bf_buffer and bf_bsize, and returns the pointer it stops at. Where
+   the pointer is on entry isn't known, so only the cell under it
+   counts as checked. */
+void print_hot (ir_t * ir, const char *name)
+{
+  print_includes ();
+  fprintf (bfout, "#define BFTYPE %s\n\n", bfstr_type);
+  if (dynamic_mem)
+    fprintf (bfout, "void bf_buffinc (BFTYPE **ptr, int need);\n\n");
+  print_io (FLUSH_STDIO);
+  fprintf (bfout, "char bf_obuf[%d];\n\n", OBUF_SIZE);
+  fprintf (bfout, "BFTYPE *%s;\n\n", bfstr_buffer);
+  fprintf (bfout, "int %s; /* Buffer size */\n\n", bfstr_bsize);
+  print_scan_funcs ();
+  if (dynamic_mem)
+    print_buffinc ();
+
+  fprintf (bfout, "BFTYPE *%s (BFTYPE *%s) {\n", name, bfstr_ptr);
+  reach_lo = reach_hi = 0;
+  obuf_left = obuf_used = 0;
+  indent = 1;
+  codegen_region (ir);
+  fprintf (bfout, "  return %s;\n", bfstr_ptr);
+  fprintf (bfout, "}\n");
+}
+
 /* Print increment instruction(s) */
-void print_incdec (char c, int n)
+void print_incdec (char c, int n, int off)
 {
   if (bfthreads)
     {
@@ -550,6 +974,7 @@ void print_incdec (char c, int n)
       return;
     }
 
+  char *cell = cell_ptr (off);
   if (bfbignum)
     {
       char *addsub;
@@ -559,17 +984,17 @@ void print_incdec (char c, int n)
 	addsub = "add";
 
       print_indent ();
-      fprintf (bfout, "mpz_%s_ui (*%s, *%s, %d);\n",
-	       addsub, bfstr_ptr, bfstr_ptr, n);
+      fprintf (bfout, "mpz_%s_ui (*%s, *%s, %d);\n", addsub, cell, cell, n);
     }
   else
     {
       print_indent ();
-      fprintf (bfout, "*%s %c= %d;\n", bfstr_ptr, c, n);
+      fprintf (bfout, "*%s %c= %d;\n", cell, c, n);
     }
 }
 
-/* Print pointer move instruction(s) */
+/* Print pointer move instruction(s). Cell checks are made for a
+   whole block by print_block (). */
 void print_move (char c, int n)
 {
   if (c == '>')
@@ -577,82 +1002,278 @@ void print_move (char c, int n)
   else
     c = '-';
 
+  reach_lo -= c == '+' ? n : -n;
+  reach_hi -= c == '+' ? n : -n;
+
+  print_indent ();
   if (bfthreads)
-    {
-      print_indent ();
-      fprintf (bfout, "cell_move (ptri, %c%d);\n", c, n);
-      return;
-    }
+    fprintf (bfout, "cell_move (ptri, %c%d);\n", c, n);
+  else
+    fprintf (bfout, "%s %c= %d;\n", bfstr_ptr, c, n);
+}
 
-  if (dynamic_mem)
+/* Find the cells the block of straight-line code starting at i
+   touches or moves the pointer to, from ptr + *lo to ptr + *hi. This
+   includes the cell read by the loop test that follows it. The block's
+   pointer move is returned in *move, and the index just past it is
+   returned. */
+int block_reach (ir_t * ir, int i, int *lo, int *hi, int *move)
+{
+  int pos = 0;
+  *lo = *hi = 0;
+  for (; i < ir->count; i++)
     {
-      print_indent ();
-      fprintf (bfout, "%s %c= %d;\n", bfstr_ptr, c, n);
-
-      /* Check against upper bound */
-      if (c == '+')
+      int inst = ir->inst[i];
+      if (inst == IM_LOOP || inst == IM_END || inst == IM_SCAN)
+	break;
+      switch (inst)
 	{
-	  print_indent ();
-	  fprintf (bfout, "if (%s - %s >= %s)\n",
-		   bfstr_ptr, bfstr_buffer, bfstr_bsize);
-	  print_indent ();
-	  fprintf (bfout, "  bf_buffinc (&%s);\n", bfstr_ptr);
+	case IM_PRGHT:
+	  pos += ir->src[i];
+	  if (pos > *hi)
+	    *hi = pos;
+	  continue;
+
+	case IM_PLEFT:
+	  pos -= ir->src[i];
+	  if (pos < *lo)
+	    *lo = pos;
+	  continue;
+
+	case IM_NOP:
+	case IM_COUT:
+	  continue;
+
+	case IM_CPROD:
+	  if (pos + ir->src2[i] < *lo)
+	    *lo = pos + ir->src2[i];
+	  if (pos + ir->src2[i] > *hi)
+	    *hi = pos + ir->src2[i];
+	  /* Fall through */
+	case IM_CADD:
+	case IM_CMUL:
+	  if (pos + ir->src[i] < *lo)
+	    *lo = pos + ir->src[i];
+	  if (pos + ir->src[i] > *hi)
+	    *hi = pos + ir->src[i];
+	  break;
 	}
+      if (pos + ir->dst[i] < *lo)
+	*lo = pos + ir->dst[i];
+      if (pos + ir->dst[i] > *hi)
+	*hi = pos + ir->dst[i];
     }
-  else
+  *move = pos;
+  return i;
+}
+
+/* Print checks for the cells from ptr + lo to ptr + hi that aren't
+   already known to be inside the buffer. */
+static void print_range (int lo, int hi)
+{
+  if (hi > reach_hi)
     {
-      print_indent ();
-      fprintf (bfout, "%s %c= %d;\n", bfstr_ptr, c, n);
+      print_reach (hi);
+      reach_hi = hi;
+    }
+  if (lo < reach_lo)
+    {
+      print_reach (lo);
+      reach_lo = lo;
+    }
+}
 
-      /* Check against upper bound */
-      if (check_bounds && c == '+')
+/* Whether the pointer ends each pass through the body of the loop at
+   i where it started. */
+static int loop_balanced (ir_t * ir, int i)
+{
+  int end = ir->match[i], pos = 0;
+  for (i++; i < end; i++)
+    switch (ir->inst[i])
+      {
+      case IM_PRGHT:
+	pos += ir->src[i];
+	break;
+
+      case IM_PLEFT:
+	pos -= ir->src[i];
+	break;
+
+      case IM_SCAN:
+	return 0;
+
+      case IM_LOOP:
+	if (!loop_balanced (ir, i))
+	  return 0;
+	i = ir->match[i];
+	break;
+      }
+  return pos == 0;
+}
+
+/* Find the furthest cell right of the pointer that the code from i
+   touches before the pointer moves by an unknown amount: straight-line
+   code and balanced loops, up to a scan, an unbalanced loop or the end
+   of the enclosing loop. The index where that code ends is returned
+   in *end. */
+static int region_reach (ir_t * ir, int i, int *end)
+{
+  int pos = 0, top = 0, lo, hi, move;
+  while (i < ir->count)
+    {
+      int inst = ir->inst[i];
+      if (inst == IM_END || inst == IM_SCAN
+	  || (inst == IM_LOOP && !loop_balanced (ir, i)))
+	break;
+      if (inst == IM_LOOP)
 	{
-	  print_indent ();
-	  fprintf (bfout, "if (%s - %s >= %s) {\n",
-		   bfstr_ptr, bfstr_buffer, bfstr_bsize);
-	  print_indent ();
-	  fprintf (bfout, "  fprintf (stderr, \"%s:%d:%s\\n\");",
-		   bfstr_name, lineno, bfstr_bounderr);
-	  print_indent ();
-	  fprintf (bfout, "  abort ();");
-	  print_indent ();
-	  fprintf (bfout, "}");
+	  hi = pos + region_reach (ir, i + 1, end);
+	  i = ir->match[i] + 1;
 	}
+      else
+	{
+	  i = block_reach (ir, i, &lo, &hi, &move);
+	  hi += pos;
+	  pos += move;
+	}
+      if (hi > top)
+	top = hi;
     }
+  *end = i;
+  return top;
+}
 
-  /* Check lower bounds */
-  if (check_bounds && c == '-')
+/* Grow the buffer for the code from i up to where the pointer next
+   moves by an unknown amount, unless that's already been done. */
+static void print_region (ir_t * ir, int i)
+{
+  if (dynamic_mem && i >= region_end)
+    print_range (reach_lo, region_reach (ir, i, &region_end));
+}
+
+/* Print checks covering every cell the block of straight-line code
+   starting at i touches. In dynamic memory the buffer is grown
+   for the rest of the region at once. */
+void print_block (ir_t * ir, int i)
+{
+  if (bfthreads || (!dynamic_mem && !check_bounds))
+    return;
+
+  int lo, hi, move;
+  block_reach (ir, i, &lo, &hi, &move);
+  if (hi > reach_hi)
+    print_region (ir, i);
+  print_range (lo, hi);
+}
+
+/* Start tracking reach through the loop at i. A balanced body starts
+   at the same cell every time around, so the checks for its first
+   block need only pass when it's first entered, and are made ahead
+   of the loop instead. Other loops start each pass not knowing where
+   the pointer is. */
+static void reach_enter (ir_t * ir, int i)
+{
+  if (bfthreads || (!dynamic_mem && !check_bounds))
+    return;
+
+  if (reach_depth == reach_size)
+    {
+      reach_size = reach_size ? reach_size * 2 : 64;
+      reach_stack = (reach_t *) bfrealloc (reach_stack,
+					   reach_size * sizeof (reach_t));
+    }
+  reach_t *r = &reach_stack[reach_depth++];
+  r->balanced = loop_balanced (ir, i);
+  if (!r->balanced)
+    {
+      r->lo = r->hi = 0;
+      reach_lo = reach_hi = 0;
+      return;
+    }
+
+  /* Growing the buffer early does no harm, and holds after the loop
+     too. A bounds check has to wait for the loop test. */
+  int lo, hi, move;
+  block_reach (ir, i + 1, &lo, &hi, &move);
+  print_region (ir, i);
+  r->lo = reach_lo;
+  r->hi = reach_hi;
+  if (check_bounds && (lo < reach_lo || hi > reach_hi))
     {
       print_indent ();
-      fprintf (bfout, "if (%s < %s) {\n", bfstr_ptr, bfstr_buffer);
-      print_indent ();
-      fprintf (bfout, "  fprintf (stderr, \"%s:%d:%s\\n\");\n",
-	       bfstr_name, lineno, bfstr_bounderr);
-      print_indent ();
-      fprintf (bfout, "  abort ();");
+      fprintf (bfout, bfbignum ? "if (mpz_sgn (*%s)) {\n" : "if (*%s) {\n",
+	       bfstr_ptr);
+      indent++;
+      print_range (lo, hi);
+      indent--;
       print_indent ();
-      fprintf (bfout, "}");
+      fprintf (bfout, "}\n");
     }
+  print_range (lo, hi);
+}
+
+/* Stop tracking reach through a loop, as it exits */
+static void reach_leave ()
+{
+  if (bfthreads || (!dynamic_mem && !check_bounds))
+    return;
+
+  reach_t *r = &reach_stack[--reach_depth];
+  reach_lo = r->lo;
+  reach_hi = r->hi;
+}
+
+/* Name the address of cell ptr + off. The two most recent results
+   stay valid. */
+char *cell_ptr (int off)
+{
+  static char buf[3][64];
+  static int n = 0;
+  if (off == 0)
+    return bfstr_ptr;
+  n = (n + 1) % 3;
+  snprintf (buf[n], sizeof (buf[n]), "(%s %c %d)", bfstr_ptr,
+	    off < 0 ? '-' : '+', off < 0 ? -off : off);
+  return buf[n];
 }
 
 /* Print input code */
-void print_input ()
+void print_input (int off)
 {
   print_indent ();
   if (!bfthreads)
-    fprintf (bfout, bfstr_get, bfstr_ptr);
+    fprintf (bfout, bfstr_get, cell_ptr (off));
   else
-    fprintf (bfout, "cell_set (ptri, getchar ());\n");
+    fprintf (bfout, "cell_set (ptri, (char) bf_getc ());\n");
 }
 
 /* Print output code */
-void print_output ()
+void print_output (int off)
 {
   print_indent ();
   if (!bfthreads)
-    fprintf (bfout, bfstr_put, bfstr_ptr);
+    fprintf (bfout, bfstr_put, cell_ptr (off));
   else
-    fprintf (bfout, "putchar (cell_get (ptri));\n");
+    fprintf (bfout, "bf_putc (cell_get (ptri));\n");
+}
+
+/* Print output gathered into bf_obuf, written out with the last
+   output of the group. */
+void print_output_buf (int off)
+{
+  print_indent ();
+  if (bfbignum)
+    fprintf (bfout, "bf_obuf[%d] = (char) mpz_get_ui (*%s);\n",
+	     obuf_used, cell_ptr (off));
+  else
+    fprintf (bfout, "bf_obuf[%d] = (char) *%s;\n", obuf_used, cell_ptr (off));
+  obuf_used++;
+  if (--obuf_left == 0)
+    {
+      print_indent ();
+      fprintf (bfout, "bf_write (bf_obuf, %d);\n", obuf_used);
+      obuf_used = 0;
+    }
 }
 
 /* Print loop beginning */
@@ -687,104 +1308,245 @@ void print_indent ()
     }
 }
 
-void print_ccpy (int dst, int src)
+/* Print checks that make cell ptr + off safe to touch */
+void print_reach (int off)
 {
-  if (bfthreads)
+  if (off > 0 && dynamic_mem)
     {
-      if (dynamic_mem)
-	fprintf (bfout, "  pthread_mutex_lock (&mem_lock);\n");
-      else
-	fprintf (bfout, "  pthread_mutex_lock (&ptr->lock);\n");
+      print_indent ();
+      fprintf (bfout, "if (%s + %d - %s >= %s)\n",
+	       bfstr_ptr, off, bfstr_buffer, bfstr_bsize);
+      print_indent ();
+      fprintf (bfout, "  bf_buffinc (&%s, %d);\n", bfstr_ptr, off);
+    }
+  else if (off > 0 && check_bounds)
+    {
+      print_indent ();
+      fprintf (bfout, "if (%s + %d - %s >= %s) {\n",
+	       bfstr_ptr, off, bfstr_buffer, bfstr_bsize);
+      print_bounderr ();
+    }
+  else if (off < 0 && check_bounds)
+    {
+      print_indent ();
+      fprintf (bfout, "if (%s + %d < %s) {\n", bfstr_ptr, off, bfstr_buffer);
+      print_bounderr ();
     }
+}
+
+/* Print the body of a failed bounds check, closing its block */
+void print_bounderr ()
+{
+  print_indent ();
+  fprintf (bfout, "  fprintf (stderr, \"%s:%d:%s\\n\");\n",
+	   bfstr_name, lineno, bfstr_bounderr);
+  print_indent ();
+  fprintf (bfout, "  abort ();\n");
+  print_indent ();
+  fprintf (bfout, "}\n");
+}
 
-  if (check_bounds)
+/* Print a constant store. Wrapping cells hold val as unsigned, bignum
+   cells as signed. */
+void print_cset (int off, int val)
+{
+  print_indent ();
+  if (bfthreads)
+    fprintf (bfout, "cell_set (ptri, %u);\n", (unsigned) val);
+  else if (bfbignum)
+    fprintf (bfout, "mpz_set_%ci (*%s, %d);\n", val < 0 ? 's' : 'u',
+	     cell_ptr (off), val);
+  else
+    fprintf (bfout, "*%s = %uu;\n", cell_ptr (off), (unsigned) val);
+}
+
+/* Print code writing n bytes of constant output */
+void print_literal (const char *s, size_t n)
+{
+  size_t i, col = 0, start = 0;
+  for (i = 0; i < n; i++)
     {
-      /* Check lower bounds */
-      if (dst < 0)
+      /* Split long output over several calls */
+      if (i == start)
 	{
 	  print_indent ();
-	  fprintf (bfout, "if (%s + %d < %s) {\n",
-		   bfstr_ptr, dst, bfstr_buffer);
-	  print_indent ();
-	  fprintf (bfout, "  fprintf (stderr, \"%s:%d:%s\\n\");\n",
-		   bfstr_name, lineno, bfstr_bounderr);
-	  print_indent ();
-	  fprintf (bfout, "  abort ();");
-	  print_indent ();
-	  fprintf (bfout, "}");
+	  fprintf (bfout, "bf_write (\"");
+	  col = 0;
 	}
-      if (src < 0)
+
+      unsigned char ch = s[i];
+      if (ch == '"' || ch == '\\' || ch == '?')
+	col += fprintf (bfout, "\\%c", ch);
+      else if (ch == '\n')
+	col += fprintf (bfout, "\\n");
+      else if (ch >= ' ' && ch < 127)
+	col += fprintf (bfout, "%c", ch);
+      else
+	col += fprintf (bfout, "\\%03o", ch);
+
+      if (i + 1 == n || i + 1 - start == LITERAL_MAX)
 	{
-	  print_indent ();
-	  fprintf (bfout, "if (%s + %d < %s) {\n",
-		   bfstr_ptr, src, bfstr_buffer);
-	  print_indent ();
-	  fprintf (bfout, "  fprintf (stderr, \"%s:%d:%s\\n\");\n",
-		   bfstr_name, lineno, bfstr_bounderr);
-	  print_indent ();
-	  fprintf (bfout, "  abort ();");
-	  print_indent ();
-	  fprintf (bfout, "}");
+	  fprintf (bfout, "\", %zu);\n", i + 1 - start);
+	  start = i + 1;
 	}
-
-      /* Check upper bounds */
-      if (dst > 0)
+      else if (ch == '\n' || col >= 64)
 	{
+	  fprintf (bfout, "\"\n");
 	  print_indent ();
-	  fprintf (bfout, "if (%s + %d > %s) {\n",
-		   bfstr_ptr, dst, bfstr_buffer);
-	  print_indent ();
-	  fprintf (bfout, "  fprintf (stderr, \"%s:%d:%s\\n\");\n",
-		   bfstr_name, lineno, bfstr_bounderr);
-	  print_indent ();
-	  fprintf (bfout, "  abort ();");
-	  print_indent ();
-	  fprintf (bfout, "}");
+	  fprintf (bfout, "          \"");
+	  col = 0;
 	}
-      if (src > 0)
+    }
+}
+
+/* Print code setting the first n cells of the tape from cells, and
+   moving the pointer to pos. The tape must be fresh. */
+void print_seed (const unsigned *cells, int n, int pos)
+{
+  int lo = 0, i;
+  while (n > 0 && cells[n - 1] == 0)
+    n--;
+  while (lo < n && cells[lo] == 0)
+    lo++;
+
+  int reach = n - 1 > pos ? n - 1 : pos;
+  if (dynamic_mem && reach > 0)
+    print_reach (reach);
+  if (lo < n)
+    {
+      print_indent ();
+      fprintf (bfout, "static const BFTYPE bf_seed[%d] = {", n - lo);
+      for (i = lo; i < n; i++)
 	{
-	  print_indent ();
-	  fprintf (bfout, "if (%s + %d > %s) {\n",
-		   bfstr_ptr, src, bfstr_buffer);
-	  print_indent ();
-	  fprintf (bfout, "  fprintf (stderr, \"%s:%d:%s\\n\");\n",
-		   bfstr_name, lineno, bfstr_bounderr);
-	  print_indent ();
-	  fprintf (bfout, "  abort ();");
-	  print_indent ();
-	  fprintf (bfout, "}");
+	  if ((i - lo) % 12 == 0)
+	    {
+	      fprintf (bfout, "\n");
+	      print_indent ();
+	      fprintf (bfout, " ");
+	    }
+	  fprintf (bfout, " %u,", cells[i]);
 	}
+      fprintf (bfout, "\n");
+      print_indent ();
+      fprintf (bfout, "};\n");
+      print_indent ();
+      fprintf (bfout, "memcpy (%s, bf_seed, sizeof (bf_seed));\n",
+	       cell_ptr (lo));
     }
+  if (pos != 0)
+    print_move (pos > 0 ? '>' : '<', pos > 0 ? pos : -pos);
+}
 
-  if (!bfbignum)
+/* Print a scan for the nearest zero cell, stepping by n. The search
+   stops at the ends of the buffer, where it grows the buffer, fails a
+   bounds check, or carries on cell by cell as an unchecked loop
+   would. */
+void print_scan (int n)
+{
+  char *end = dynamic_mem || check_bounds ? bfstr_bsize : NULL;
+  char size[16];
+  if (!end)
     {
+      snprintf (size, sizeof (size), "%d", mem_size);
+      end = size;
+    }
+
+  print_indent ();
+  if (guard_mem)
+    fprintf (bfout, "%s = bf_scan_%s (%s, bf_tape_%s, %d);\n", bfstr_ptr,
+	     n > 0 ? "right" : "left", bfstr_ptr, n > 0 ? "hi" : "lo",
+	     n > 0 ? n : -n);
+  else if (n > 0)
+    fprintf (bfout, "%s = bf_scan_right (%s, %s + %s, %d);\n",
+	     bfstr_ptr, bfstr_ptr, bfstr_buffer, end, n);
+  else
+    fprintf (bfout, "%s = bf_scan_left (%s, %s, %d);\n",
+	     bfstr_ptr, bfstr_ptr, bfstr_buffer, -n);
+
+  if (n > 0 && dynamic_mem)
+    {
+      /* Fresh cells are zero, so growing ends the scan. */
       print_indent ();
-      fprintf (bfout, "*(%s + %d) = *(%s + %d) + *(%s + %d);\n",
-	       bfstr_ptr, dst, bfstr_ptr, dst, bfstr_ptr, src);
+      fprintf (bfout, "if (%s - %s >= %s)\n",
+	       bfstr_ptr, bfstr_buffer, bfstr_bsize);
+      print_indent ();
+      fprintf (bfout, "  bf_buffinc (&%s, 0);\n", bfstr_ptr);
+    }
+  else if (n > 0 && check_bounds)
+    {
+      print_indent ();
+      fprintf (bfout, "if (%s - %s >= %s) {\n",
+	       bfstr_ptr, bfstr_buffer, bfstr_bsize);
+      print_bounderr ();
+    }
+  else if (check_bounds)
+    {
+      print_indent ();
+      fprintf (bfout, "if (%s < %s) {\n", bfstr_ptr, bfstr_buffer);
+      print_bounderr ();
     }
   else
     {
       print_indent ();
-      fprintf (bfout, "mpz_add (*(%s + %d), *(%s + %d), *(%s + %d));\n",
-	       bfstr_ptr, dst, bfstr_ptr, dst, bfstr_ptr, src);
+      fprintf (bfout, "while (*%s)\n", bfstr_ptr);
+      print_indent ();
+      fprintf (bfout, "  %s %c= %d;\n", bfstr_ptr, n > 0 ? '+' : '-',
+	       n > 0 ? n : -n);
+    }
+}
+
+/* Print cell multiply-add, *(ptr + dst) += *(ptr + src) * k. Only
+   used without threads. */
+void print_ccpy (int dst, int src, int k)
+{
+  char *d = cell_ptr (dst), *r = cell_ptr (src);
+  print_indent ();
+  if (bfbignum)
+    {
+      if (k == 1)
+	fprintf (bfout, "mpz_add (*%s, *%s, *%s);\n", d, d, r);
+      else
+	fprintf (bfout, "mpz_%s_ui (*%s, *%s, %u);\n",
+		 k < 0 ? "submul" : "addmul", d, r,
+		 k < 0 ? -(unsigned) k : (unsigned) k);
     }
+  else if (k == 1)
+    fprintf (bfout, "*%s += *%s;\n", d, r);
+  else
+    fprintf (bfout, "*%s %c= *%s * %uu;\n", d, k < 0 ? '-' : '+', r,
+	     k < 0 ? -(unsigned) k : (unsigned) k);
+}
 
-  if (bfthreads)
+/* Print cell product-add, *(ptr + dst) += *(ptr + a) * *(ptr + b) * k.
+   Only used without threads. */
+void print_cprod (int dst, int a, int b, int k)
+{
+  char *d = cell_ptr (dst), *x = cell_ptr (a), *y = cell_ptr (b);
+  print_indent ();
+  if (bfbignum)
     {
-      if (dynamic_mem)
-	fprintf (bfout, "  pthread_mutex_unlock (&mem_lock);\n");
+      fprintf (bfout, "mpz_mul (bf_prod, *%s, *%s); ", x, y);
+      if (k == 1)
+	fprintf (bfout, "mpz_add (*%s, *%s, bf_prod);\n", d, d);
       else
-	fprintf (bfout, "  pthread_mutex_unlock (&ptr->lock);\n");
+	fprintf (bfout, "mpz_%s_ui (*%s, bf_prod, %u);\n",
+		 k < 0 ? "submul" : "addmul", d,
+		 k < 0 ? -(unsigned) k : (unsigned) k);
     }
+  else if (k == 1)
+    fprintf (bfout, "*%s += (unsigned) *%s * *%s;\n", d, x, y);
+  else
+    fprintf (bfout, "*%s %c= (unsigned) *%s * *%s * %uu;\n", d,
+	     k < 0 ? '-' : '+', x, y, k < 0 ? -(unsigned) k : (unsigned) k);
 }
 
-void print_cclr ()
+void print_cclr (int off)
 {
   print_indent ();
   if (bfbignum && !bfthreads)
-    fprintf (bfout, "mpz_set_ui (*%s, 0);\n", bfstr_ptr);
+    fprintf (bfout, "mpz_set_ui (*%s, 0);\n", cell_ptr (off));
   else if (bfthreads)
     fprintf (bfout, "cell_set (ptri, 0);\n");
   else
-    fprintf (bfout, "*%s = 0;\n", bfstr_ptr);
+    fprintf (bfout, "*%s = 0;\n", cell_ptr (off));
 }
@@ -4,20 +4,42 @@
 #include <stdio.h>
 #include "parser.h"
 
-void im_codegen (inst_t *);	/* Walk intermediate code tree */
+void im_codegen (ir_t *);	/* Walk intermediate code */
+void codegen_begin ();		/* Start a program body */
+void codegen_region (ir_t *);	/* Body code, may be called repeatedly */
+void codegen_end ();		/* Finish a program body */
 void print_head ();		/* Program prolog */
 void print_tail ();		/* Program epilog */
-void print_incdec (char, int);	/* Increment/decrement cell */
+void print_hot (ir_t *, const char *);	/* One loop as a C file */
+void print_incdec (char, int, int);	/* Increment/decrement cell */
 void print_move (char, int);	/* Move pointer */
-void print_input ();		/* Print input command */
+void print_block (ir_t *, int);	/* Check cells for straight-line code */
+int block_reach (ir_t *, int, int *, int *, int *);	/* Cells a block touches */
+void print_input (int);		/* Print input command */
 void print_loop ();		/* Print loop beginning */
 void print_end ();		/* Print loop ending */
-void print_output ();		/* Print output command */
+void print_output (int);	/* Print output command */
+void print_output_buf (int);	/* Gather output */
 void print_indent ();		/* Print current indent level */
-void print_ccpy (int, int);	/* Add one cell to another. */
-void print_cclr ();		/* Cell clear */
+void print_ccpy (int, int, int);	/* Add multiple of one cell to another */
+void print_cprod (int, int, int, int);	/* Add product of two cells */
+void print_reach (int);		/* Check a cell offset is reachable */
+void print_cclr (int);		/* Cell clear */
+void print_cset (int, int);	/* Cell set */
+void print_literal (const char *, size_t);	/* Constant output */
+void print_seed (const unsigned *, int, int);	/* Preset tape */
+void print_scan (int);		/* Scan for a zero cell */
+void print_scan_funcs ();	/* Zero cell search functions */
+void print_io (int);		/* I/O runtime */
+void print_bounderr ();		/* Failed bounds check */
+void print_guard ();		/* Guard page tape runtime */
+char *cell_ptr (int);		/* Address of a cell */
+int jit_run (ir_t *);		/* Run as machine code, in process */
+void elf_write (FILE *, ir_t *);	/* Write as an x86-64 executable */
+void interp_run (ir_t *, int);	/* Run with the bytecode interpreter */
 
 extern int indent;		/* Indentation level */
+extern int lineno;		/* Source line being generated */
 
 /* Code strings */
 extern char *bfstr_type;	/* Cell type */
@@ -35,18 +57,30 @@ extern char *bfstr_memerr;	/* Malloc error string */
 extern char *bfstr_bounderr;	/* Bound error string */
 
 /* Options */
-extern FILE *bfin;		/* Input stream */
 extern FILE *bfout;		/* Output stream */
 extern int compile_output;	/* Run compiler */
 extern int dynamic_mem;		/* Dynamic memory */
 extern int mem_grow_rate;	/* Memory grow rate */
 extern int mem_size;		/* Starting memory size */
 extern int check_bounds;	/* Runtime bounds checking */
+extern int guard_mem;		/* Reserved tape with guard pages */
+extern long guard_cells;	/* Cells each side of the origin, 0 for most */
 extern int dump_core;		/* Dump memory core */
 extern int bfbignum;		/* Bignum mode */
 extern int optimize_c;		/* Run compiler optimizer */
 extern int optimize;		/* Run optimization */
 extern int pass_comments;	/* Pass comments to output */
 extern int bfthreads;		/* Enable threading. */
+extern int cell_bits;		/* Cell width, 0 for bignum */
+extern int flush_mode;		/* I/O runtime, one of FLUSH_* */
+
+/* I/O runtimes. Generated code reads and writes through bf_getc (),
+   bf_putc () and bf_write (), which are stdio, or buffers of the
+   program's own that are written out when full, at exit, and as the
+   flush policy says. */
+#define FLUSH_STDIO       0	/* stdio, unlocked without threads */
+#define FLUSH_NONE        1	/* Own buffers, flushed only when full */
+#define FLUSH_LINE        2	/* ... and at each newline */
+#define FLUSH_INTERACTIVE 3	/* ... and before waiting for input */
 
 #endif
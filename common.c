@@ -16,3 +16,55 @@ void *bfmalloc (size_t size)
     }
   return dat;
 }
+
+void *bfrealloc (void *ptr, size_t size)
+{
+  void *dat = realloc (ptr, size);
+  if (dat == NULL)
+    {
+      fprintf (stderr, "%s: failed to realloc - %s\n",
+	       progname, strerror (errno));
+      abort ();
+    }
+  return dat;
+}
+
+/* Arena blocks are at least this big. */
+#define ARENA_BLOCK (1 << 20)
+
+void *arena_alloc (arena_t * arena, size_t size)
+{
+  /* Keep everything pointer aligned */
+  size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+
+  arena_blk *blk = arena->blk;
+  if (blk == NULL || blk->used + size > blk->size)
+    {
+      size_t bsize = ARENA_BLOCK;
+      if (size > bsize)
+	bsize = size;
+      blk = (arena_blk *) bfmalloc (sizeof (arena_blk) + bsize);
+      blk->prev = arena->blk;
+      blk->size = bsize;
+      blk->used = 0;
+      arena->blk = blk;
+    }
+
+  void *dat = (char *) (blk + 1) + blk->used;
+  blk->used += size;
+  arena->used += size;
+  if (arena->used > arena->peak)
+    arena->peak = arena->used;
+  return dat;
+}
+
+void arena_release (arena_t * arena)
+{
+  while (arena->blk != NULL)
+    {
+      arena_blk *prev = arena->blk->prev;
+      free (arena->blk);
+      arena->blk = prev;
+    }
+  arena->used = 0;
+}
@@ -19,6 +19,9 @@
 #else /* Turn everything on */
 #  define EN_COMPILE
 #  define EN_BIGNUM
+#  define HAVE_MMAP 1
+#  define HAVE_LIBPTHREAD 1
+#  define HAVE_DLFCN_H 1
 #  define PACKAGE_NAME "wbf2c"
 #  define PACKAGE_VERSION ""
 #endif
@@ -26,5 +29,25 @@
 extern char *progname;
 
 void *bfmalloc (size_t size);
+void *bfrealloc (void *ptr, size_t size);
+
+/* Bump allocator for the optimizer's scratch space. Everything
+   allocated from an arena is released together by arena_release (). */
+typedef struct arena_blk
+{
+  struct arena_blk *prev;
+  size_t size;
+  size_t used;
+} arena_blk;
+
+typedef struct arena_t
+{
+  arena_blk *blk;		/* Current block */
+  size_t used;			/* Bytes handed out since release */
+  size_t peak;			/* High water mark of used */
+} arena_t;
+
+void *arena_alloc (arena_t * arena, size_t size);
+void arena_release (arena_t * arena);
 
 #endif
@@ -0,0 +1,461 @@
+#include "common.h"
+#include "parser.h"
+#include "codegen.h"
+#include "x86.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Load addresses. The code is loaded along with the file headers.
+   The context, its I/O buffers and a static buffer are zero-filled
+   memory of their own. */
+#define ELF_TEXT 0x400000
+#define ELF_DATA 0x40000000
+#define ELF_HEAD (64 + 2 * 56)	/* ELF header, two program headers */
+
+/* Context, laid out as x86.h says and followed by I/O buffers. The
+   runtime below has these offsets built in. */
+#define ELF_OUTLEN 56		/* Bytes waiting in the output buffer */
+#define ELF_INPOS  64		/* Next input buffer byte */
+#define ELF_INLEN  72		/* Bytes in the input buffer */
+#define ELF_OUT    80		/* Output buffer */
+#define ELF_BUF    4096		/* Size of each buffer */
+#define ELF_IN     (ELF_OUT + ELF_BUF)	/* Input buffer */
+#define ELF_TAPE   (3 * 4096)	/* Static buffer, past the context */
+
+/* The bytes of a 32-bit displacement or immediate, in code tables */
+#define ELF_D32(v) (v) & 0xff, (v) >> 8 & 0xff, (v) >> 16 & 0xff, \
+    (v) >> 24 & 0xff
+
+/* Append a little-endian 64-bit value */
+static void elf_u64 (x86_t * x, unsigned long long v)
+{
+  x86_imm (x, v, 4);
+  x86_imm (x, v >> 32, 4);
+}
+
+/* Jump or call with opcode op to target. Returns the offset for
+   x86_patch (), for a target not yet emitted. */
+static size_t elf_jump (x86_t * x, int op, size_t target)
+{
+  x86_byte (x, op);
+  x86_imm (x, 0, 4);
+  x86_patch (x, x->len, target);
+  return x->len;
+}
+
+/* Conditional jump, jcc rel32, to target. Returns as elf_jump (). */
+static size_t elf_jcc (x86_t * x, int cond, size_t target)
+{
+  x86_byte (x, 0x0f);
+  return elf_jump (x, cond, target);
+}
+
+/* Write len bytes of text at offset str to stderr */
+static void elf_message (x86_t * x, size_t str, size_t len)
+{
+  x86_byte (x, 0xbf);		/* mov edi, 2 */
+  x86_imm (x, 2, 4);
+  x86_byte (x, 0xba);		/* mov edx, len */
+  x86_imm (x, len, 4);
+  x86_byte (x, 0x48);		/* lea rsi, [rip + str] */
+  x86_byte (x, 0x8d);
+  x86_byte (x, 0x35);
+  x86_imm (x, 0, 4);
+  x86_patch (x, x->len, str);
+  x86_byte (x, 0xb8);		/* mov eax, 1 (write) */
+  x86_imm (x, 1, 4);
+  x86_byte (x, 0x0f);		/* syscall */
+  x86_byte (x, 0x05);
+}
+
+/* Load the cell at rsi, zero extended, into eax */
+static void elf_load (x86_t * x)
+{
+  static const unsigned char load[3][3] = {
+    {0x0f, 0xb6, 0x06},		/* movzx eax, byte [rsi] */
+    {0x0f, 0xb7, 0x06},		/* movzx eax, word [rsi] */
+    {0x8b, 0x06}		/* mov eax, [rsi] */
+  };
+  x86_emit (x, load[x->cell / 2], x->cell == 4 ? 2 : 3);
+}
+
+/* Runtime offsets */
+typedef struct elf_rt_t
+{
+  size_t fn[X86_FUNCS];		/* Entry points, as x86.h numbers them */
+  size_t flush;			/* Write out the output buffer */
+  size_t memerr;		/* Report running out of memory */
+} elf_rt_t;
+
+/* Emit the runtime the program calls through its context: buffered
+   I/O with read () and write (), buffer growth with mremap (), and
+   error reports that end in SIGABRT, as abort () does. */
+static void elf_runtime (x86_t * x, elf_rt_t * rt)
+{
+  char pre[256], post[256], mem[256];
+  size_t pre_at, post_at, mem_at, abrt;
+
+  /* Error messages, as the C code words them */
+  snprintf (pre, sizeof (pre), "%s:", bfstr_name);
+  snprintf (post, sizeof (post), ":%s\n", bfstr_bounderr);
+  snprintf (mem, sizeof (mem), "%s:%s\n", bfstr_name, bfstr_memerr);
+  pre_at = x->len;
+  x86_emit (x, pre, strlen (pre));
+  post_at = x->len;
+  x86_emit (x, post, strlen (post));
+  mem_at = x->len;
+  x86_emit (x, mem, strlen (mem));
+
+  /* flush (ctx), keeps ctx in rdi */
+  static const unsigned char flush[] = {
+    0x49, 0x89, 0xf8,		/* mov r8, rdi */
+    0x48, 0x8b, 0x57, ELF_OUTLEN,	/* mov rdx, [rdi + ELF_OUTLEN] */
+    0x48, 0x8d, 0x77, ELF_OUT,	/* lea rsi, [rdi + ELF_OUT] */
+    0x48, 0x85, 0xd2,		/* again: test rdx, rdx */
+    0x7e, 0x19,			/* jle done */
+    0xbf, 0x01, 0x00, 0x00, 0x00,	/* mov edi, 1 */
+    0xb8, 0x01, 0x00, 0x00, 0x00,	/* mov eax, 1 (write) */
+    0x0f, 0x05,			/* syscall */
+    0x48, 0x85, 0xc0,		/* test rax, rax */
+    0x7e, 0x08,			/* jle done, dropping the rest */
+    0x48, 0x01, 0xc6,		/* add rsi, rax */
+    0x48, 0x29, 0xc2,		/* sub rdx, rax */
+    0xeb, 0xe2,			/* jmp again */
+    0x49, 0xc7, 0x40, ELF_OUTLEN, 0, 0, 0, 0,	/* done: mov qword
+							   [r8 + ELF_OUTLEN], 0 */
+    0x4c, 0x89, 0xc7,		/* mov rdi, r8 */
+    0xc3			/* ret */
+  };
+  rt->flush = x->len;
+  x86_emit (x, flush, sizeof (flush));
+
+  /* putc (ctx, c) */
+  static const unsigned char putc[] = {
+    0x48, 0x8b, 0x47, ELF_OUTLEN,	/* mov rax, [rdi + ELF_OUTLEN] */
+    0x40, 0x88, 0x74, 0x07, ELF_OUT,	/* mov [rdi + rax + ELF_OUT], sil */
+    0x48, 0xff, 0xc0,		/* inc rax */
+    0x48, 0x89, 0x47, ELF_OUTLEN,	/* mov [rdi + ELF_OUTLEN], rax */
+    0x48, 0x3d, ELF_D32 (ELF_BUF)	/* cmp rax, ELF_BUF */
+  };
+  rt->fn[X86_PUTC] = x->len;
+  x86_emit (x, putc, sizeof (putc));
+  elf_jcc (x, 0x84, rt->flush);	/* je flush */
+  x86_byte (x, 0xc3);		/* ret */
+
+  /* getc (ctx). Output is flushed before waiting for input. */
+  static const unsigned char getc_head[] = {
+    0x48, 0x8b, 0x47, ELF_INPOS,	/* mov rax, [rdi + ELF_INPOS] */
+    0x48, 0x3b, 0x47, ELF_INLEN,	/* cmp rax, [rdi + ELF_INLEN] */
+    0x72, 0x25			/* jb have */
+  };
+  static const unsigned char getc_tail[] = {
+    0x31, 0xff,			/* xor edi, edi */
+    0x49, 0x8d, 0xb0, ELF_D32 (ELF_IN),	/* lea rsi, [r8 + ELF_IN] */
+    0xba, ELF_D32 (ELF_BUF),	/* mov edx, ELF_BUF */
+    0x31, 0xc0,			/* xor eax, eax (read) */
+    0x0f, 0x05,			/* syscall */
+    0x4c, 0x89, 0xc7,		/* mov rdi, r8 */
+    0x48, 0x85, 0xc0,		/* test rax, rax */
+    0x7e, 0x18,			/* jle eof */
+    0x48, 0x89, 0x47, ELF_INLEN,	/* mov [rdi + ELF_INLEN], rax */
+    0x31, 0xc0,			/* xor eax, eax */
+    0x0f, 0xb6, 0x8c, 0x07, ELF_D32 (ELF_IN),	/* have: movzx ecx,
+						   byte [rdi + rax
+						   + ELF_IN] */
+    0x48, 0xff, 0xc0,		/* inc rax */
+    0x48, 0x89, 0x47, ELF_INPOS,	/* mov [rdi + ELF_INPOS], rax */
+    0x89, 0xc8,			/* mov eax, ecx */
+    0xc3,			/* ret */
+    0xb8, 0xff, 0xff, 0xff, 0xff,	/* eof: mov eax, -1 */
+    0xc3			/* ret */
+  };
+  rt->fn[X86_GETC] = x->len;
+  x86_emit (x, getc_head, sizeof (getc_head));
+  elf_jump (x, 0xe8, rt->flush);	/* call flush */
+  x86_emit (x, getc_tail, sizeof (getc_tail));
+
+  /* Die of SIGABRT */
+  static const unsigned char abort_code[] = {
+    0xb8, 0x27, 0x00, 0x00, 0x00,	/* mov eax, 39 (getpid) */
+    0x0f, 0x05,			/* syscall */
+    0x48, 0x89, 0xc7,		/* mov rdi, rax */
+    0xbe, 0x06, 0x00, 0x00, 0x00,	/* mov esi, 6 (SIGABRT) */
+    0xb8, 0x3e, 0x00, 0x00, 0x00,	/* mov eax, 62 (kill) */
+    0x0f, 0x05,			/* syscall */
+    0xbf, 0x86, 0x00, 0x00, 0x00,	/* mov edi, 134 */
+    0xb8, 0xe7, 0x00, 0x00, 0x00,	/* mov eax, 231 (exit_group) */
+    0x0f, 0x05			/* syscall */
+  };
+  abrt = x->len;
+  x86_emit (x, abort_code, sizeof (abort_code));
+
+  rt->memerr = x->len;
+  elf_message (x, mem_at, strlen (mem));
+  elf_jump (x, 0xe9, abrt);
+
+  /* bounds (ctx, line) */
+  static const unsigned char bounds[] = {
+    0x48, 0x83, 0xec, 0x18,	/* sub rsp, 24 */
+    0x48, 0x8d, 0x7c, 0x24, 0x10,	/* lea rdi, [rsp + 16] */
+    0x89, 0xf0,			/* mov eax, esi */
+    0xb9, 0x0a, 0x00, 0x00, 0x00,	/* mov ecx, 10 */
+    0x31, 0xd2,			/* digit: xor edx, edx */
+    0xf7, 0xf1,			/* div ecx */
+    0x80, 0xc2, 0x30,		/* add dl, '0' */
+    0x48, 0xff, 0xcf,		/* dec rdi */
+    0x88, 0x17,			/* mov [rdi], dl */
+    0x85, 0xc0,			/* test eax, eax */
+    0x75, 0xf0,			/* jne digit */
+    0x49, 0x89, 0xf9		/* mov r9, rdi */
+  };
+  static const unsigned char bounds_line[] = {
+    0xbf, 0x02, 0x00, 0x00, 0x00,	/* mov edi, 2 */
+    0x4c, 0x89, 0xce,		/* mov rsi, r9 */
+    0x48, 0x8d, 0x54, 0x24, 0x10,	/* lea rdx, [rsp + 16] */
+    0x4c, 0x29, 0xca,		/* sub rdx, r9 */
+    0xb8, 0x01, 0x00, 0x00, 0x00,	/* mov eax, 1 (write) */
+    0x0f, 0x05			/* syscall */
+  };
+  rt->fn[X86_BOUNDS] = x->len;
+  x86_emit (x, bounds, sizeof (bounds));
+  elf_message (x, pre_at, strlen (pre));
+  x86_emit (x, bounds_line, sizeof (bounds_line));
+  elf_message (x, post_at, strlen (post));
+  elf_jump (x, 0xe9, abrt);
+
+  /* grow (ctx, ptr, need), as bf_buffinc () does */
+  static const unsigned char grow_head[] = {
+    0x49, 0x89, 0xf8,		/* mov r8, rdi */
+    0x49, 0x89, 0xf1,		/* mov r9, rsi */
+    0x4c, 0x2b, 0x4f, X86_BASE,	/* sub r9, [rdi + X86_BASE] */
+    0x48, 0x63, 0xd2,		/* movsxd rdx, edx */
+    0x48, 0x6b, 0xd2		/* imul rdx, rdx, cell */
+  };
+  static const unsigned char grow_size[] = {
+    0x4c, 0x01, 0xca,		/* add rdx, r9 */
+    0x48, 0x8b, 0x77, X86_END,	/* mov rsi, [rdi + X86_END] */
+    0x48, 0x2b, 0x77, X86_BASE,	/* sub rsi, [rdi + X86_BASE] */
+    0x48, 0x89, 0xf1,		/* mov rcx, rsi */
+    0x48, 0x39, 0xca,		/* again: cmp rdx, rcx */
+    0x72, 0x09,			/* jb big */
+    0x48, 0x69, 0xc9		/* imul rcx, rcx, rate */
+  };
+  static const unsigned char grow_remap[] = {
+    0xeb, 0xf2,			/* jmp again */
+    0x49, 0x8b, 0x78, X86_BASE,	/* big: mov rdi, [r8 + X86_BASE] */
+    0x48, 0x89, 0xca,		/* mov rdx, rcx */
+    0x41, 0xba, 0x01, 0x00, 0x00, 0x00,	/* mov r10d, 1 (MREMAP_MAYMOVE) */
+    0xb8, 0x19, 0x00, 0x00, 0x00,	/* mov eax, 25 (mremap) */
+    0x0f, 0x05,			/* syscall */
+    0x48, 0x3d, 0x00, 0xf0, 0xff, 0xff	/* cmp rax, -4096 */
+  };
+  static const unsigned char grow_tail[] = {
+    0x49, 0x89, 0x40, X86_BASE,	/* mov [r8 + X86_BASE], rax */
+    0x48, 0x01, 0xc2,		/* add rdx, rax */
+    0x49, 0x89, 0x50, X86_END,	/* mov [r8 + X86_END], rdx */
+    0x4c, 0x01, 0xc8,		/* add rax, r9 */
+    0xc3			/* ret */
+  };
+  rt->fn[X86_GROW] = x->len;
+  x86_emit (x, grow_head, sizeof (grow_head));
+  x86_byte (x, x->cell);
+  x86_emit (x, grow_size, sizeof (grow_size));
+  x86_imm (x, mem_grow_rate, 4);
+  x86_emit (x, grow_remap, sizeof (grow_remap));
+  elf_jcc (x, 0x87, rt->memerr);	/* ja memerr */
+  x86_emit (x, grow_tail, sizeof (grow_tail));
+
+  /* scan (ctx, ptr, n, line). The ends of the buffer are handled as
+     bf_scan_right () and bf_scan_left () are. */
+  static const unsigned char scan_head[] = {
+    0x49, 0x89, 0xf8,		/* mov r8, rdi */
+    0x41, 0x89, 0xc9,		/* mov r9d, ecx */
+    0x48, 0x63, 0xd2,		/* movsxd rdx, edx */
+    0x48, 0x6b, 0xd2		/* imul rdx, rdx, cell */
+  };
+  static const unsigned char scan_range[] = {
+    0x49, 0x3b, 0x70, X86_BASE,	/* cmp rsi, [r8 + X86_BASE] */
+    0x72, 0x00,			/* jb out */
+    0x49, 0x3b, 0x70, X86_END,	/* cmp rsi, [r8 + X86_END] */
+    0x73, 0x00			/* jae out */
+  };
+  static const unsigned char scan_grow[] = {
+    0x49, 0x3b, 0x70, X86_END,	/* cmp rsi, [r8 + X86_END] */
+    0x72, 0x0a,			/* jb below */
+    0x4c, 0x89, 0xc7,		/* mov rdi, r8 */
+    0x31, 0xd2			/* xor edx, edx */
+  };
+  static const unsigned char scan_bounds[] = {
+    0x44, 0x89, 0xce		/* mov esi, r9d */
+  };
+  static const unsigned char scan_step[] = {
+    0x48, 0x01, 0xd6		/* add rsi, rdx */
+  };
+  static const unsigned char scan_done[] = {
+    0x48, 0x89, 0xf0,		/* mov rax, rsi */
+    0xc3			/* ret */
+  };
+  size_t loop, out, out2, zero, unchecked;
+  rt->fn[X86_SCAN] = x->len;
+  x86_emit (x, scan_head, sizeof (scan_head));
+  x86_byte (x, x->cell);
+  loop = x->len;
+  x86_emit (x, scan_range, sizeof (scan_range));
+  out = x->len - 6;
+  out2 = x->len;
+  elf_load (x);
+  x86_byte (x, 0x85);		/* test eax, eax */
+  x86_byte (x, 0xc0);
+  zero = elf_jcc (x, 0x84, 0);	/* je unchecked, below */
+  x86_emit (x, scan_step, sizeof (scan_step));
+  elf_jump (x, 0xe9, loop);
+
+  /* Off the buffer */
+  x->code[out - 1] = x->len - out;
+  x->code[out2 - 1] = x->len - out2;
+  if (dynamic_mem)
+    {
+      x86_emit (x, scan_grow, sizeof (scan_grow));
+      elf_jump (x, 0xe9, rt->fn[X86_GROW]);	/* Fresh cells are zero */
+    }
+  if (check_bounds)
+    {
+      x86_emit (x, scan_bounds, sizeof (scan_bounds));
+      elf_jump (x, 0xe9, rt->fn[X86_BOUNDS]);
+    }
+
+  /* Unchecked, like the C code */
+  unchecked = x->len;
+  elf_load (x);
+  x86_byte (x, 0x85);		/* test eax, eax */
+  x86_byte (x, 0xc0);
+  x86_byte (x, 0x74);		/* je done */
+  x86_byte (x, sizeof (scan_step) + 5);
+  x86_emit (x, scan_step, sizeof (scan_step));
+  elf_jump (x, 0xe9, unchecked);
+  x86_emit (x, scan_done, sizeof (scan_done));
+  x86_patch (x, zero, unchecked);
+}
+
+/* Write a program as a static x86-64 Linux executable. The code calls
+   the runtime above through the context, as x86.h lays it out, and
+   the buffer is either static or mapped with mmap () and grown with
+   mremap (). */
+void elf_write (FILE * out, ir_t * ir)
+{
+  x86_t x = { 0 }, h = { 0 };
+  elf_rt_t rt;
+  size_t prog, entry, size;
+  int i;
+
+  x.cell = cell_bits / 8;
+  size = (size_t) mem_size * x.cell;
+  elf_runtime (&x, &rt);
+  prog = x.len;
+  x86_program (&x, ir);
+
+  /* Entry: fill in the context, set up the buffer, run, flush */
+  entry = x.len;
+  x86_byte (&x, 0xbf);		/* mov edi, ELF_DATA */
+  x86_imm (&x, ELF_DATA, 4);
+  for (i = 0; i < X86_FUNCS; i++)
+    {
+      x86_byte (&x, 0x48);	/* mov qword [rdi + 8 * i], fn */
+      x86_byte (&x, 0xc7);
+      x86_byte (&x, 0x47);
+      x86_byte (&x, 8 * i);
+      x86_imm (&x, ELF_TEXT + ELF_HEAD + rt.fn[i], 4);
+    }
+  if (dynamic_mem)
+    {
+      static const unsigned char map[] = {
+	0x31, 0xff,		/* xor edi, edi */
+	0xba, 0x03, 0x00, 0x00, 0x00,	/* mov edx, PROT_READ | PROT_WRITE */
+	0x41, 0xba, 0x22, 0x00, 0x00, 0x00,	/* mov r10d, MAP_PRIVATE
+						   | MAP_ANONYMOUS */
+	0x49, 0xc7, 0xc0, 0xff, 0xff, 0xff, 0xff,	/* mov r8, -1 */
+	0x45, 0x31, 0xc9,	/* xor r9d, r9d */
+	0xb8, 0x09, 0x00, 0x00, 0x00,	/* mov eax, 9 (mmap) */
+	0x0f, 0x05,		/* syscall */
+	0x48, 0x3d, 0x00, 0xf0, 0xff, 0xff	/* cmp rax, -4096 */
+      };
+      x86_byte (&x, 0x48);	/* mov rsi, size */
+      x86_byte (&x, 0xbe);
+      elf_u64 (&x, size);
+      x86_emit (&x, map, sizeof (map));
+      elf_jcc (&x, 0x87, rt.memerr);	/* ja memerr */
+      x86_byte (&x, 0xbf);	/* mov edi, ELF_DATA */
+      x86_imm (&x, ELF_DATA, 4);
+    }
+  else
+    {
+      x86_byte (&x, 0x48);	/* mov rax, ELF_DATA + ELF_TAPE */
+      x86_byte (&x, 0xb8);
+      elf_u64 (&x, ELF_DATA + ELF_TAPE);
+      x86_byte (&x, 0x48);	/* mov rsi, size */
+      x86_byte (&x, 0xbe);
+      elf_u64 (&x, size);
+    }
+  static const unsigned char run[] = {
+    0x48, 0x89, 0x47, X86_BASE,	/* mov [rdi + X86_BASE], rax */
+    0x48, 0x01, 0xc6,		/* add rsi, rax */
+    0x48, 0x89, 0x77, X86_END,	/* mov [rdi + X86_END], rsi */
+    0x48, 0x8b, 0x77, X86_BASE	/* mov rsi, [rdi + X86_BASE] */
+  };
+  static const unsigned char quit[] = {
+    0x31, 0xff,			/* xor edi, edi */
+    0xb8, 0xe7, 0x00, 0x00, 0x00,	/* mov eax, 231 (exit_group) */
+    0x0f, 0x05			/* syscall */
+  };
+  x86_emit (&x, run, sizeof (run));
+  elf_jump (&x, 0xe8, prog);	/* call program */
+  x86_byte (&x, 0xbf);		/* mov edi, ELF_DATA */
+  x86_imm (&x, ELF_DATA, 4);
+  elf_jump (&x, 0xe8, rt.flush);	/* call flush */
+  x86_emit (&x, quit, sizeof (quit));
+
+  /* ELF header */
+  static const unsigned char ident[16] = {
+    0x7f, 'E', 'L', 'F', 2, 1, 1	/* 64-bit, little-endian, v1 */
+  };
+  x86_emit (&h, ident, sizeof (ident));
+  x86_imm (&h, 2, 2);		/* Executable */
+  x86_imm (&h, 62, 2);		/* x86-64 */
+  x86_imm (&h, 1, 4);		/* Version */
+  elf_u64 (&h, ELF_TEXT + ELF_HEAD + entry);
+  elf_u64 (&h, 64);		/* Program headers */
+  elf_u64 (&h, 0);		/* No section headers */
+  x86_imm (&h, 0, 4);		/* Flags */
+  x86_imm (&h, 64, 2);		/* Header size */
+  x86_imm (&h, 56, 2);		/* Program header size, count */
+  x86_imm (&h, 2, 2);
+  x86_imm (&h, 64, 2);		/* Section header size, count, names */
+  x86_imm (&h, 0, 2);
+  x86_imm (&h, 0, 2);
+
+  /* Code, read and execute */
+  x86_imm (&h, 1, 4);		/* Loadable */
+  x86_imm (&h, 5, 4);
+  elf_u64 (&h, 0);		/* From the start of the file */
+  elf_u64 (&h, ELF_TEXT);
+  elf_u64 (&h, ELF_TEXT);
+  elf_u64 (&h, ELF_HEAD + x.len);
+  elf_u64 (&h, ELF_HEAD + x.len);
+  elf_u64 (&h, 4096);
+
+  /* Context and static buffer, read and write, zero filled */
+  x86_imm (&h, 1, 4);		/* Loadable */
+  x86_imm (&h, 6, 4);
+  elf_u64 (&h, 0);
+  elf_u64 (&h, ELF_DATA);
+  elf_u64 (&h, ELF_DATA);
+  elf_u64 (&h, 0);
+  elf_u64 (&h, ELF_TAPE + (dynamic_mem ? 0 : size));
+  elf_u64 (&h, 4096);
+
+  fwrite (h.code, 1, h.len, out);
+  fwrite (x.code, 1, x.len, out);
+  x86_free (&h);
+  x86_free (&x);
+}
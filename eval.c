@@ -0,0 +1,198 @@
+#include "common.h"
+#include "parser.h"
+#include "codegen.h"
+
+#include <string.h>
+#include <limits.h>
+
+/* Most cells the compile-time run may use */
+#define EVAL_CELLS 65536
+
+/* Compile-time machine */
+typedef struct eval_t
+{
+  unsigned *tape;		/* Cells */
+  int cells;			/* Cells usable, lo <= cell < cells */
+  int hi;			/* Cells touched, cell < hi */
+  int pos;			/* Pointer */
+  unsigned mask;		/* Cell value mask */
+  char *out;			/* Output so far */
+  size_t out_len;
+  size_t out_size;
+} eval_t;
+
+/* Reset the machine to a fresh tape. */
+static void eval_reset (eval_t * ev)
+{
+  memset (ev->tape, 0, ev->hi * sizeof (unsigned));
+  ev->hi = 0;
+  ev->pos = 0;
+  ev->out_len = 0;
+}
+
+/* Index of cell off from the pointer, or -1 if the run can't reach it */
+static int eval_cell (eval_t * ev, int off)
+{
+  long long a = (long long) ev->pos + off;
+  if (a < 0 || a >= ev->cells)
+    return -1;
+  if (a >= ev->hi)
+    ev->hi = a + 1;
+  return a;
+}
+
+/* Run ir from the start until it needs input, leaves the reachable
+   cells, runs out of steps, or reaches top-level instruction stop.
+   Returns the last top-level instruction reached, where generated
+   code can take over, or ir->count if the program finished. */
+static int eval_run (ir_t * ir, eval_t * ev, int stop, long steps)
+{
+  int i = 0, depth = 0, top = 0, a, b, c;
+
+  while (i < ir->count)
+    {
+      if (depth == 0)
+	{
+	  top = i;
+	  if (i == stop)
+	    break;
+	}
+      if (steps-- <= 0)
+	break;
+
+      switch (ir->inst[i])
+	{
+	case IM_CINC:
+	case IM_CDEC:
+	  if ((a = eval_cell (ev, ir->dst[i])) < 0)
+	    return top;
+	  ev->tape[a] += ir->inst[i] == IM_CINC ? ir->src[i] : -ir->src[i];
+	  ev->tape[a] &= ev->mask;
+	  break;
+
+	case IM_PRGHT:
+	  ev->pos += ir->src[i];
+	  break;
+
+	case IM_PLEFT:
+	  ev->pos -= ir->src[i];
+	  break;
+
+	case IM_OUT:
+	case IM_COUT:
+	  a = 0;
+	  if (ir->inst[i] == IM_OUT && (a = eval_cell (ev, ir->dst[i])) < 0)
+	    return top;
+	  if (ev->out_len == ev->out_size)
+	    {
+	      ev->out_size = ev->out_size ? ev->out_size * 2 : 4096;
+	      ev->out = (char *) bfrealloc (ev->out, ev->out_size);
+	    }
+	  ev->out[ev->out_len++] = ir->inst[i] == IM_OUT
+	    ? (char) ev->tape[a] : (char) ir->val[i];
+	  break;
+
+	case IM_CADD:
+	case IM_CMUL:
+	  if ((a = eval_cell (ev, ir->dst[i])) < 0
+	      || (b = eval_cell (ev, ir->src[i])) < 0)
+	    return top;
+	  ev->tape[a] += ev->tape[b] * (ir->inst[i] == IM_CADD ? 1
+					: (unsigned) ir->val[i]);
+	  ev->tape[a] &= ev->mask;
+	  break;
+
+	case IM_CPROD:
+	  if ((a = eval_cell (ev, ir->dst[i])) < 0
+	      || (b = eval_cell (ev, ir->src[i])) < 0
+	      || (c = eval_cell (ev, ir->src2[i])) < 0)
+	    return top;
+	  ev->tape[a] += ev->tape[b] * ev->tape[c] * (unsigned) ir->val[i];
+	  ev->tape[a] &= ev->mask;
+	  break;
+
+	case IM_CCLR:
+	case IM_CSET:
+	  if ((a = eval_cell (ev, ir->dst[i])) < 0)
+	    return top;
+	  ev->tape[a] = ir->inst[i] == IM_CSET ? ir->val[i] & ev->mask : 0;
+	  break;
+
+	case IM_LOOP:
+	  if ((a = eval_cell (ev, 0)) < 0)
+	    return top;
+	  if (ev->tape[a] == 0)
+	    i = ir->match[i];
+	  else
+	    depth++;
+	  break;
+
+	case IM_END:
+	  if ((a = eval_cell (ev, 0)) < 0)
+	    return top;
+	  if (ev->tape[a] != 0)
+	    i = ir->match[i];
+	  else
+	    depth--;
+	  break;
+
+	case IM_SCAN:
+	  while ((a = eval_cell (ev, 0)) >= 0 && ev->tape[a] != 0)
+	    {
+	      ev->pos += ir->src[i];
+	      steps--;
+	    }
+	  if (a < 0)
+	    return top;
+	  break;
+
+	case IM_IN:
+	  return top;
+	}
+      i++;
+    }
+
+  return depth == 0 ? i : top;
+}
+
+/* Run the start of a program at compile time, up to its first input
+   or for at most steps instructions. Code reproducing the output and
+   tape at that point is printed, and the part of ir it covers is
+   dropped, so the generated program starts where the run stopped. */
+void im_eval (ir_t * ir, long steps)
+{
+  eval_t ev;
+  int i, cut;
+
+  ev.cells = EVAL_CELLS;
+  if (!dynamic_mem && mem_size < ev.cells)
+    ev.cells = mem_size;
+  ev.tape = (unsigned *) bfmalloc (ev.cells * sizeof (unsigned));
+  ev.mask = cell_bits == 32 ? ~0u : (1u << cell_bits) - 1;
+  ev.out = NULL;
+  ev.out_size = 0;
+  ev.hi = ev.cells;
+  eval_reset (&ev);
+
+  /* Generated code can only pick up between top-level instructions,
+     so find the last one reached, then run again to stop there. */
+  cut = eval_run (ir, &ev, -1, steps);
+  if (cut > 0)
+    {
+      eval_reset (&ev);
+      eval_run (ir, &ev, cut, LONG_MAX);
+
+      print_literal (ev.out, ev.out_len);
+      print_seed (ev.tape, ev.hi, ev.pos);
+
+      ir_t out = { 0 };
+      for (i = cut; i < ir->count; i++)
+	ir_copy (&out, ir, i);
+      ir_link (&out);
+      ir_free (ir);
+      *ir = out;
+    }
+
+  free (ev.tape);
+  free (ev.out);
+}
@@ -0,0 +1,501 @@
+#include "common.h"
+#include "parser.h"
+#include "codegen.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Tiered execution compiles hot loops with the C compiler on a worker
+   thread, and loads them as shared objects. */
+#if defined(EN_COMPILE) && HAVE_LIBPTHREAD && HAVE_DLFCN_H
+#  define TIER
+#  include <pthread.h>
+#  include <dlfcn.h>
+#  include <fcntl.h>
+#  include <signal.h>
+#  include <unistd.h>
+#  include <sys/wait.h>
+#endif
+
+/* Loop entries before a loop is compiled */
+#define TIER_HOT 1000
+
+/* Bytecode operations */
+enum
+{
+  BC_ADD,			/* Cell a += k */
+  BC_MOVE,			/* Pointer += a */
+  BC_SET,			/* Cell a = k */
+  BC_MULADD,			/* Cell a += cell b * k */
+  BC_PROD,			/* Cell a += cell b * cell c * k */
+  BC_IN,			/* Read cell a */
+  BC_OUT,			/* Write cell a */
+  BC_COUT,			/* Write byte k */
+  BC_JZ,			/* Jump to a if the cell is zero */
+  BC_JNZ,			/* Jump to a unless the cell is zero */
+  BC_LOOP,			/* BC_JZ, or run loop b compiled */
+  BC_SCAN,			/* Step by a to a zero cell */
+  BC_CHECK,			/* Make cells a to b reachable */
+  BC_HALT
+};
+
+/* One bytecode instruction. Cells are offsets from the pointer, jumps
+   are instruction indexes. */
+typedef struct bc_t
+{
+  unsigned char op;
+  int a, b, c;
+  unsigned k;
+  int line;			/* Source line, for errors */
+} bc_t;
+
+/* Bytecode program being built */
+typedef struct bcprog_t
+{
+  bc_t *code;
+  int count;
+  int size;
+} bcprog_t;
+
+static bc_t *bc_add (bcprog_t * bp, int op, int a, unsigned k, int line)
+{
+  if (bp->count == bp->size)
+    {
+      bp->size = bp->size ? bp->size * 2 : 1024;
+      bp->code = (bc_t *) bfrealloc (bp->code, bp->size * sizeof (bc_t));
+    }
+  bc_t *bc = &bp->code[bp->count++];
+  memset (bc, 0, sizeof (bc_t));
+  bc->op = op;
+  bc->a = a;
+  bc->k = k;
+  bc->line = line;
+  return bc;
+}
+
+/* Translate a program to bytecode, with loop jumps resolved and cell
+   checks once per straight-line block. Tiered, loops are numbered in
+   order and *loops set to their count. */
+static void bc_compile (bcprog_t * bp, ir_t * ir, int tiered, int *loops)
+{
+  int *open = (int *) bfmalloc ((ir->count + 1) * sizeof (int));
+  int depth = 0, i, lo, hi, move;
+  bc_t *bc;
+  *loops = 0;
+
+  for (i = 0; i < ir->count; i++)
+    {
+      int inst = ir->inst[i], line = ir->lineno[i];
+
+      /* Entering straight-line code */
+      if ((dynamic_mem || check_bounds)
+	  && (i == 0 || ir->inst[i - 1] == IM_LOOP
+	      || ir->inst[i - 1] == IM_END || ir->inst[i - 1] == IM_SCAN)
+	  && inst != IM_LOOP && inst != IM_END && inst != IM_SCAN)
+	{
+	  block_reach (ir, i, &lo, &hi, &move);
+	  if (hi > 0 || (lo < 0 && check_bounds))
+	    bc_add (bp, BC_CHECK, lo, 0, line)->b = hi;
+	}
+
+      switch (inst)
+	{
+	case IM_CINC:
+	  bc_add (bp, BC_ADD, ir->dst[i], ir->src[i], line);
+	  break;
+
+	case IM_CDEC:
+	  bc_add (bp, BC_ADD, ir->dst[i], -(unsigned) ir->src[i], line);
+	  break;
+
+	case IM_PRGHT:
+	  bc_add (bp, BC_MOVE, ir->src[i], 0, line);
+	  break;
+
+	case IM_PLEFT:
+	  bc_add (bp, BC_MOVE, -ir->src[i], 0, line);
+	  break;
+
+	case IM_CCLR:
+	  bc_add (bp, BC_SET, ir->dst[i], 0, line);
+	  break;
+
+	case IM_CSET:
+	  bc_add (bp, BC_SET, ir->dst[i], ir->val[i], line);
+	  break;
+
+	case IM_CADD:
+	  bc_add (bp, BC_MULADD, ir->dst[i], 1, line)->b = ir->src[i];
+	  break;
+
+	case IM_CMUL:
+	  bc_add (bp, BC_MULADD, ir->dst[i], ir->val[i], line)->b = ir->src[i];
+	  break;
+
+	case IM_CPROD:
+	  bc = bc_add (bp, BC_PROD, ir->dst[i], ir->val[i], line);
+	  bc->b = ir->src[i];
+	  bc->c = ir->src2[i];
+	  break;
+
+	case IM_IN:
+	  bc_add (bp, BC_IN, ir->dst[i], 0, line);
+	  break;
+
+	case IM_OUT:
+	  bc_add (bp, BC_OUT, ir->dst[i], 0, line);
+	  break;
+
+	case IM_COUT:
+	  bc_add (bp, BC_COUT, 0, ir->val[i] & 0xff, line);
+	  break;
+
+	case IM_LOOP:
+	  open[depth++] = bp->count;
+	  if (tiered)
+	    {
+	      bc = bc_add (bp, BC_LOOP, 0, 0, line);
+	      bc->b = (*loops)++;
+	      bc->c = i;
+	    }
+	  else
+	    bc_add (bp, BC_JZ, 0, 0, line);
+	  break;
+
+	case IM_END:
+	  {
+	    int start = open[--depth];
+	    bc_add (bp, BC_JNZ, start + 1, 0, line);
+	    bp->code[start].a = bp->count;
+	  }
+	  break;
+
+	case IM_SCAN:
+	  bc_add (bp, BC_SCAN, ir->src[i], 0, line);
+	  break;
+	}
+    }
+  bc_add (bp, BC_HALT, 0, 0, 0);
+  free (open);
+}
+
+/* Tape of a running program */
+typedef struct tape_t
+{
+  unsigned char *base;
+  unsigned char *end;
+  int cell;			/* Bytes per cell */
+} tape_t;
+
+/* Grow the tape until cell need from p fits, as bf_buffinc () does.
+   Returns the moved pointer. */
+static unsigned char *tape_grow (tape_t * t, unsigned char *p, long need)
+{
+  size_t offset = p - t->base;
+  size_t old = t->end - t->base, size = old;
+  while (offset + (size_t) need * t->cell >= size)
+    size *= mem_grow_rate;
+
+  unsigned char *base = (unsigned char *) realloc (t->base, size);
+  if (base == NULL)
+    {
+      fprintf (stderr, "%s:%s\n", bfstr_name, bfstr_memerr);
+      abort ();
+    }
+  memset (base + old, 0, size - old);
+  t->base = base;
+  t->end = base + size;
+  return base + offset;
+}
+
+static void tape_bounds (int line)
+{
+  fprintf (stderr, "%s:%d:%s\n", bfstr_name, line, bfstr_bounderr);
+  abort ();
+}
+
+typedef struct tier_t tier_t;
+
+#ifdef TIER
+/* A loop that may get compiled */
+typedef struct hot_t
+{
+  void *fn;			/* Compiled loop, once it's loaded */
+  void **buffer;		/* Its bf_buffer */
+  int *bsize;			/* Its bf_bsize */
+  int count;			/* Entries, up to TIER_HOT */
+  int ir;			/* Index of the loop in the program */
+} hot_t;
+
+/* Background compiler. Loops are built in the order they get hot. */
+struct tier_t
+{
+  ir_t *ir;			/* Program */
+  hot_t *hot;			/* Loops, by number */
+  int *queue;			/* Loops waiting to be built */
+  int queue_head;
+  int queue_tail;
+  void **lib;			/* Loaded shared objects */
+  int libs;
+  char dir[32];			/* Scratch directory */
+  char src[64], so[64];		/* Files of the build in progress */
+  pid_t pid;			/* Running compiler, or 0 */
+  int stop;			/* The program has ended */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t worker;
+};
+
+/* The running compiler, for tier_abort () */
+static tier_t *tier_active = NULL;
+static struct sigaction tier_oldabrt;
+
+/* Stop the compiler and remove its files when the program aborts, on
+   an error here or in a compiled loop. Only async-signal-safe calls
+   are made, and abort () ends the process once this returns. */
+static void tier_abort (int sig)
+{
+  tier_t *tier = tier_active;
+  pid_t pid = __atomic_load_n (&tier->pid, __ATOMIC_RELAXED);
+  if (pid > 0)
+    {
+      kill (-pid, SIGTERM);
+      waitpid (pid, NULL, 0);
+    }
+  unlink (tier->src);
+  unlink (tier->so);
+  rmdir (tier->dir);
+}
+
+static void tier_queue (tier_t * tier, int n)
+{
+  pthread_mutex_lock (&tier->lock);
+  tier->queue[tier->queue_tail++] = n;
+  pthread_cond_signal (&tier->wake);
+  pthread_mutex_unlock (&tier->lock);
+}
+
+/* Compile loop n to a shared object, load it, and hand its entry
+   point to the interpreter. Any failure leaves the loop interpreted. */
+static void tier_build (tier_t * tier, int n)
+{
+  hot_t *h = &tier->hot[n];
+  char *src = tier->src, *lib = tier->so;
+  ir_t loop = { 0 };
+  pid_t pid = -1;
+  siginfo_t info;
+  int i, s = 0;
+
+  snprintf (src, sizeof (tier->src), "%s/loop%d.c", tier->dir, n);
+  snprintf (lib, sizeof (tier->so), "%s/loop%d.so", tier->dir, n);
+  bfout = fopen (src, "w");
+  if (bfout == NULL)
+    return;
+  for (i = h->ir; i <= tier->ir->match[h->ir]; i++)
+    ir_copy (&loop, tier->ir, i);
+  ir_link (&loop);
+  print_hot (&loop, "bf_loop");
+  fclose (bfout);
+  ir_free (&loop);
+
+  /* The compiler's messages would mix with the program's own. It
+     gets a process group of its own, so it can be stopped along with
+     the programs it runs. */
+  pthread_mutex_lock (&tier->lock);
+  if (!tier->stop)
+    {
+      pid = fork ();
+      if (pid == 0)
+	{
+	  int null = open ("/dev/null", O_WRONLY);
+	  setpgid (0, 0);
+	  dup2 (null, 1);
+	  dup2 (null, 2);
+	  execlp ("gcc", "gcc", "-x", "c", "-O2", "-shared", "-fPIC",
+		  "-o", lib, src, (char *) NULL);
+	  _exit (EXIT_FAILURE);
+	}
+      if (pid > 0)
+	{
+	  setpgid (pid, pid);
+	  tier->pid = pid;
+	}
+    }
+  pthread_mutex_unlock (&tier->lock);
+
+  /* Wait without reaping, so tier_stop () can't kill a reused pid */
+  if (pid > 0)
+    {
+      waitid (P_PID, pid, &info, WEXITED | WNOWAIT);
+      pthread_mutex_lock (&tier->lock);
+      tier->pid = 0;
+      pthread_mutex_unlock (&tier->lock);
+      waitpid (pid, &s, 0);
+    }
+  unlink (src);
+  if (pid <= 0 || !WIFEXITED (s) || WEXITSTATUS (s) != 0)
+    {
+      unlink (lib);
+      return;
+    }
+
+  void *so = dlopen (lib, RTLD_NOW | RTLD_LOCAL);
+  unlink (lib);
+  if (so == NULL)
+    return;
+  tier->lib[tier->libs++] = so;
+  void *fn = dlsym (so, "bf_loop");
+  h->buffer = (void **) dlsym (so, bfstr_buffer);
+  h->bsize = (int *) dlsym (so, bfstr_bsize);
+  if (fn && h->buffer && h->bsize)
+    __atomic_store_n (&h->fn, fn, __ATOMIC_RELEASE);
+}
+
+static void *tier_work (void *arg)
+{
+  tier_t *tier = (tier_t *) arg;
+  pthread_mutex_lock (&tier->lock);
+  for (;;)
+    {
+      while (!tier->stop && tier->queue_head == tier->queue_tail)
+	pthread_cond_wait (&tier->wake, &tier->lock);
+      if (tier->stop)
+	break;
+      int n = tier->queue[tier->queue_head++];
+      pthread_mutex_unlock (&tier->lock);
+      tier_build (tier, n);
+      pthread_mutex_lock (&tier->lock);
+    }
+  pthread_mutex_unlock (&tier->lock);
+  return NULL;
+}
+
+/* Start the compiler for the loops of bytecode code. Returns NULL if
+   it can't run. */
+static tier_t *tier_start (ir_t * ir, bcprog_t * bp, int loops)
+{
+  tier_t *tier = (tier_t *) bfmalloc (sizeof (tier_t));
+  int i;
+
+  memset (tier, 0, sizeof (tier_t));
+  strcpy (tier->dir, "/tmp/wbf2c.XXXXXX");
+  if (mkdtemp (tier->dir) == NULL)
+    {
+      free (tier);
+      return NULL;
+    }
+  tier->ir = ir;
+  tier->hot = (hot_t *) bfmalloc ((loops + 1) * sizeof (hot_t));
+  memset (tier->hot, 0, (loops + 1) * sizeof (hot_t));
+  for (i = 0; i < bp->count; i++)
+    if (bp->code[i].op == BC_LOOP)
+      tier->hot[bp->code[i].b].ir = bp->code[i].c;
+  tier->queue = (int *) bfmalloc ((loops + 1) * sizeof (int));
+  tier->lib = (void **) bfmalloc ((loops + 1) * sizeof (void *));
+  pthread_mutex_init (&tier->lock, NULL);
+  pthread_cond_init (&tier->wake, NULL);
+  if (pthread_create (&tier->worker, NULL, tier_work, tier) != 0)
+    {
+      rmdir (tier->dir);
+      free (tier->hot);
+      free (tier->queue);
+      free (tier->lib);
+      free (tier);
+      return NULL;
+    }
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = tier_abort;
+  tier_active = tier;
+  sigaction (SIGABRT, &sa, &tier_oldabrt);
+  return tier;
+}
+
+/* Stop the compiler, dropping any build in progress */
+static void tier_stop (tier_t * tier)
+{
+  int i;
+  sigaction (SIGABRT, &tier_oldabrt, NULL);
+  tier_active = NULL;
+  pthread_mutex_lock (&tier->lock);
+  tier->stop = 1;
+  if (tier->pid > 0)
+    kill (-tier->pid, SIGTERM);
+  pthread_cond_signal (&tier->wake);
+  pthread_mutex_unlock (&tier->lock);
+  pthread_join (tier->worker, NULL);
+
+  for (i = 0; i < tier->libs; i++)
+    dlclose (tier->lib[i]);
+  rmdir (tier->dir);
+  free (tier->hot);
+  free (tier->queue);
+  free (tier->lib);
+  free (tier);
+}
+#endif
+
+/* One run function per cell type */
+#define CELL unsigned char
+#define RUN bc_run8
+#include "interp_run.h"
+#undef CELL
+#undef RUN
+
+#define CELL unsigned short
+#define RUN bc_run16
+#include "interp_run.h"
+#undef CELL
+#undef RUN
+
+#define CELL unsigned int
+#define RUN bc_run32
+#include "interp_run.h"
+#undef CELL
+#undef RUN
+
+/* Run a program with the built-in interpreter. Tiered, hot loops are
+   compiled in the background and run compiled from their next
+   entry. */
+void interp_run (ir_t * ir, int tiered)
+{
+  bcprog_t bp = { 0 };
+  tier_t *tier = NULL;
+  tape_t t;
+  int loops, i;
+
+  bc_compile (&bp, ir, tiered, &loops);
+#ifdef TIER
+  if (tiered)
+    tier = tier_start (ir, &bp, loops);
+#endif
+  if (tier == NULL)
+    for (i = 0; i < bp.count; i++)
+      if (bp.code[i].op == BC_LOOP)
+	bp.code[i].op = BC_JZ;
+
+  t.cell = cell_bits / 8;
+  t.base = (unsigned char *) calloc (mem_size, t.cell);
+  if (t.base == NULL)
+    {
+      fprintf (stderr, "%s:%s\n", bfstr_name, bfstr_memerr);
+      abort ();
+    }
+  t.end = t.base + (size_t) mem_size * t.cell;
+
+  if (t.cell == 1)
+    bc_run8 (bp.code, &t, tier);
+  else if (t.cell == 2)
+    bc_run16 (bp.code, &t, tier);
+  else
+    bc_run32 (bp.code, &t, tier);
+  fflush (stdout);
+
+#ifdef TIER
+  if (tier)
+    tier_stop (tier);
+#endif
+  free (t.base);
+  free (bp.code);
+}
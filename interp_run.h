@@ -0,0 +1,131 @@
+/* Bytecode dispatch loop. interp.c includes this once per cell type,
+   with CELL defined as the type and RUN as the function name. */
+
+static void RUN (bc_t * code, tape_t * t, tier_t * tier)
+{
+  bc_t *pc = code;
+  CELL *p = (CELL *) t->base;
+
+  /* Dispatch through a table of label addresses where the compiler
+     allows it, otherwise through a switch. */
+#ifdef __GNUC__
+  static void *jump[] = {
+    &&op_ADD, &&op_MOVE, &&op_SET, &&op_MULADD, &&op_PROD, &&op_IN,
+    &&op_OUT, &&op_COUT, &&op_JZ, &&op_JNZ, &&op_LOOP, &&op_SCAN,
+    &&op_CHECK, &&op_HALT
+  };
+#  define OP(name) op_##name:
+#  define NEXT goto *jump[(++pc)->op]
+#  define JUMP(to) goto *jump[(pc = code + (to))->op]
+  goto *jump[pc->op];
+#else
+#  define OP(name) case BC_##name:
+#  define NEXT pc++; continue
+#  define JUMP(to) pc = code + (to); continue
+  for (;;)
+    switch (pc->op)
+      {
+#endif
+
+  OP (ADD)
+    p[pc->a] += pc->k;
+  NEXT;
+
+  OP (MOVE)
+    p += pc->a;
+  NEXT;
+
+  OP (SET)
+    p[pc->a] = pc->k;
+  NEXT;
+
+  OP (MULADD)
+    p[pc->a] += p[pc->b] * pc->k;
+  NEXT;
+
+  OP (PROD)
+    p[pc->a] += (unsigned) p[pc->b] * p[pc->c] * pc->k;
+  NEXT;
+
+  OP (IN)
+    p[pc->a] = (CELL) getchar ();
+  NEXT;
+
+  OP (OUT)
+    putchar ((char) p[pc->a]);
+  NEXT;
+
+  OP (COUT)
+    putchar ((char) pc->k);
+  NEXT;
+
+  OP (JZ)
+    if (*p == 0)
+    JUMP (pc->a);
+  NEXT;
+
+  OP (JNZ)
+    if (*p != 0)
+    JUMP (pc->a);
+  NEXT;
+
+  OP (LOOP)
+    if (*p == 0)
+    JUMP (pc->a);
+#ifdef TIER
+  {
+    hot_t *h = &tier->hot[pc->b];
+    void *fn = __atomic_load_n (&h->fn, __ATOMIC_ACQUIRE);
+    if (fn)
+      {
+	*h->buffer = t->base;
+	*h->bsize = (t->end - t->base) / sizeof (CELL);
+	p = ((CELL * (*)(CELL *)) fn) (p);
+	t->base = (unsigned char *) *h->buffer;
+	t->end = t->base + *h->bsize * sizeof (CELL);
+	JUMP (pc->a);
+      }
+    if (h->count < TIER_HOT && ++h->count == TIER_HOT)
+      tier_queue (tier, pc->b);
+  }
+#endif
+  NEXT;
+
+  OP (SCAN)
+    /* The ends of the tape are handled as bf_scan_right () and
+       bf_scan_left () are. */
+    while (p >= (CELL *) t->base && p < (CELL *) t->end && *p)
+      p += pc->a;
+  if (p >= (CELL *) t->end && dynamic_mem)
+    {
+      /* Fresh cells are zero */
+      p = (CELL *) tape_grow (t, (unsigned char *) p, 0);
+    }
+  else if ((p >= (CELL *) t->end || p < (CELL *) t->base) && check_bounds)
+    tape_bounds (pc->line);
+  while (*p)
+    p += pc->a;			/* Unchecked, like the C code */
+  NEXT;
+
+  OP (CHECK)
+    if (pc->b > 0 && p + pc->b >= (CELL *) t->end)
+    {
+      if (dynamic_mem)
+	p = (CELL *) tape_grow (t, (unsigned char *) p, pc->b);
+      else
+	tape_bounds (pc->line);
+    }
+  if (check_bounds && p + pc->a < (CELL *) t->base)
+    tape_bounds (pc->line);
+  NEXT;
+
+  OP (HALT)
+    return;
+
+#ifndef __GNUC__
+      }
+#endif
+#undef OP
+#undef NEXT
+#undef JUMP
+}
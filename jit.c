@@ -0,0 +1,145 @@
+#include "common.h"
+#include "parser.h"
+#include "codegen.h"
+#include "x86.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if HAVE_MMAP
+#  include <sys/mman.h>
+#endif
+
+/* Runtime context of a running program, laid out as x86.h says */
+typedef struct jit_ctx_t
+{
+  void *fn[X86_FUNCS];		/* Runtime entry points */
+  unsigned char *base;		/* Buffer start */
+  unsigned char *end;		/* Buffer end */
+  int cell;			/* Bytes per cell */
+} jit_ctx_t;
+
+static int jit_getc (jit_ctx_t * ctx)
+{
+  return getchar ();
+}
+
+static void jit_putc (jit_ctx_t * ctx, int c)
+{
+  putchar ((char) c);
+}
+
+/* Grow the buffer until cell need from ptr fits, as bf_buffinc ()
+   does. Returns the moved pointer. */
+static unsigned char *jit_grow (jit_ctx_t * ctx, unsigned char *ptr,
+				int need)
+{
+  size_t offset = ptr - ctx->base;
+  size_t old = ctx->end - ctx->base, size = old;
+  while (offset + (size_t) need * ctx->cell >= size)
+    size *= mem_grow_rate;
+
+  unsigned char *base = (unsigned char *) realloc (ctx->base, size);
+  if (base == NULL)
+    {
+      fprintf (stderr, "%s:%s\n", bfstr_name, bfstr_memerr);
+      abort ();
+    }
+  memset (base + old, 0, size - old);
+  ctx->base = base;
+  ctx->end = base + size;
+  return base + offset;
+}
+
+static void jit_bounds (jit_ctx_t * ctx, int line)
+{
+  fprintf (stderr, "%s:%d:%s\n", bfstr_name, line, bfstr_bounderr);
+  abort ();
+}
+
+/* Value of the cell at p */
+static unsigned jit_cell (jit_ctx_t * ctx, unsigned char *p)
+{
+  switch (ctx->cell)
+    {
+    case 1:
+      return *p;
+    case 2:
+      return *(unsigned short *) p;
+    }
+  return *(unsigned *) p;
+}
+
+/* Step by n cells from ptr to the nearest zero cell. The ends of the
+   buffer are handled as bf_scan_right () and bf_scan_left () are. */
+static unsigned char *jit_scan (jit_ctx_t * ctx, unsigned char *ptr, int n,
+				int line)
+{
+  long step = (long) n * ctx->cell;
+  if (ctx->cell == 1 && n == 1 && ptr < ctx->end)
+    {
+      unsigned char *z = memchr (ptr, 0, ctx->end - ptr);
+      ptr = z ? z : ctx->end;
+    }
+  else
+    while (ptr >= ctx->base && ptr < ctx->end && jit_cell (ctx, ptr))
+      ptr += step;
+
+  if (ptr >= ctx->end && dynamic_mem)
+    return jit_grow (ctx, ptr, 0);	/* Fresh cells are zero */
+  if ((ptr >= ctx->end || ptr < ctx->base) && check_bounds)
+    jit_bounds (ctx, line);
+  while (jit_cell (ctx, ptr))
+    ptr += step;		/* Unchecked, like the C code */
+  return ptr;
+}
+
+/* Compile a program to machine code and run it right away. Returns
+   nonzero if executable memory isn't available. */
+int jit_run (ir_t * ir)
+{
+#if HAVE_MMAP && defined(__x86_64__)
+  x86_t x = { 0 };
+  x86_program (&x, ir);
+
+  void *code = mmap (NULL, x.len, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED)
+    {
+      x86_free (&x);
+      return 1;
+    }
+  memcpy (code, x.code, x.len);
+  if (mprotect (code, x.len, PROT_READ | PROT_EXEC) != 0)
+    {
+      munmap (code, x.len);
+      x86_free (&x);
+      return 1;
+    }
+
+  jit_ctx_t ctx;
+  ctx.fn[X86_GETC] = (void *) jit_getc;
+  ctx.fn[X86_PUTC] = (void *) jit_putc;
+  ctx.fn[X86_GROW] = (void *) jit_grow;
+  ctx.fn[X86_BOUNDS] = (void *) jit_bounds;
+  ctx.fn[X86_SCAN] = (void *) jit_scan;
+  ctx.cell = cell_bits / 8;
+  ctx.base = (unsigned char *) calloc (mem_size, ctx.cell);
+  if (ctx.base == NULL)
+    {
+      fprintf (stderr, "%s:%s\n", bfstr_name, bfstr_memerr);
+      abort ();
+    }
+  ctx.end = ctx.base + (size_t) mem_size * ctx.cell;
+
+  ((void (*)(jit_ctx_t *, unsigned char *)) code) (&ctx, ctx.base);
+  fflush (stdout);
+
+  free (ctx.base);
+  munmap (code, x.len);
+  x86_free (&x);
+  return 0;
+#else
+  return 1;
+#endif
+}
@@ -7,11 +7,16 @@
 #include <errno.h>
 #include <math.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 
 #include "parser.h"		/* Code reading */
 #include "codegen.h"		/* Code writing */
 #include "common.h"		/* Needed by all */
 
+#ifdef HAVE_LIBPTHREAD
+#  include <pthread.h>
+#endif
+
 char *progname = "";
 char *version = "0.1-alpha";
 
@@ -21,6 +26,239 @@ int set_type (char *s);
 char *outfile = "-";
 char *midfile;
 
+int mem_stats = 0;		/* Report compiler memory use */
+int stream = 0;			/* Emit code as regions finish */
+long eval_steps = 0;		/* Compile-time run length */
+int elf = 0;			/* Write an x86-64 executable */
+int mem_size_set = 0;		/* --mem-size given */
+int run = 0;			/* Run instead: 'r' machine code, 'i' bytecode,
+				   'j' tiered */
+
+/* One program for --threads */
+typedef struct job_t
+{
+  char *name;			/* File name, "-" for stdin */
+  parser_t parser;		/* Parsed and optimized program */
+  int err;			/* Result of parse_file () */
+  int done;			/* Ready for code generation */
+} job_t;
+
+job_t *jobs;
+int job_count;
+int job_next = 0;
+
+#ifdef HAVE_LIBPTHREAD
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+pthread_t *workers;
+int worker_count = 0;
+#endif
+
+/* Scan and parse one file into p. Returns 0 on success, -1 for
+   mismatched brackets, otherwise the errno from opening the file. */
+int parse_file (parser_t * p, char *name)
+{
+  FILE *in = stdin;
+  if (strcmp (name, "-") != 0)
+    {
+      in = fopen (name, "r");
+      if (in == NULL)
+	return errno;
+    }
+
+  char *run;
+  size_t run_len, i;
+  bfscan_open (p, in);
+  while ((run_len = bfscan (p, &run)) > 0)
+    {
+      for (i = 0; i < run_len; i++)
+	bfparse (p, run[i]);
+    }
+  bfscan_close (p);
+  if (in != stdin)
+    fclose (in);
+
+  /* Mismatched brackets */
+  if (bfparse_depth (p) != 0)
+    return -1;
+  return 0;
+}
+
+/* Streaming: optimize and emit a finished region, then drop it. */
+void emit_region (parser_t * p)
+{
+  static int start = 1;		/* First region, on a fresh tape */
+  if (optimize)
+    im_opt (&p->ir, start);
+  start = 0;
+  codegen_region (&p->ir);
+  ir_free (&p->ir);
+}
+
+/* Report a parse_file () failure and quit. */
+void parse_error (char *name, int err)
+{
+  if (err == -1)
+    {
+      if (strcmp (name, "-") == 0)
+	name = "stdin";
+      fprintf (stderr, "%s: mismatched brackets in %s\n", progname, name);
+    }
+  else
+    fprintf (stderr, "%s: failed to open file %s - %s\n",
+	     progname, name, strerror (err));
+  exit (EXIT_FAILURE);
+}
+
+/* Parse and optimize a --threads program. */
+void run_job (job_t * job)
+{
+  job->err = parse_file (&job->parser, job->name);
+  if (job->err == 0)
+    {
+      bfparse (&job->parser, 0);
+      if (optimize)
+	im_opt (&job->parser.ir, 0);
+    }
+}
+
+#ifdef HAVE_LIBPTHREAD
+/* Worker thread: take jobs in order until none are left. */
+void *job_worker (void *x)
+{
+  while (1)
+    {
+      pthread_mutex_lock (&job_lock);
+      int i = job_next++;
+      pthread_mutex_unlock (&job_lock);
+      if (i >= job_count)
+	return NULL;
+
+      run_job (&jobs[i]);
+
+      pthread_mutex_lock (&job_lock);
+      jobs[i].done = 1;
+      pthread_cond_broadcast (&job_cond);
+      pthread_mutex_unlock (&job_lock);
+    }
+}
+#endif
+
+/* Start one worker per processor, when there is more than one job. */
+void start_workers ()
+{
+#ifdef HAVE_LIBPTHREAD
+  long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+  if (ncpu > job_count)
+    ncpu = job_count;
+  if (ncpu < 2)
+    return;
+
+  workers = (pthread_t *) bfmalloc (ncpu * sizeof (pthread_t));
+  for (worker_count = 0; worker_count < ncpu; worker_count++)
+    if (pthread_create (&workers[worker_count], NULL, job_worker, NULL))
+      break;
+#endif
+}
+
+/* Wait for job i to be ready. Without workers, run it here. */
+job_t *wait_job (int i)
+{
+#ifdef HAVE_LIBPTHREAD
+  if (worker_count > 0)
+    {
+      pthread_mutex_lock (&job_lock);
+      while (!jobs[i].done)
+	pthread_cond_wait (&job_cond, &job_lock);
+      pthread_mutex_unlock (&job_lock);
+      return &jobs[i];
+    }
+#endif
+  run_job (&jobs[i]);
+  return &jobs[i];
+}
+
+void stop_workers ()
+{
+#ifdef HAVE_LIBPTHREAD
+  int i;
+  for (i = 0; i < worker_count; i++)
+    pthread_join (workers[i], NULL);
+  if (worker_count > 0)
+    free (workers);
+  worker_count = 0;
+#endif
+}
+
+/* Parse and optimize the whole program at once */
+void whole_program (parser_t * parser, int argc, char **argv)
+{
+  parser_init (parser);
+  for (; optind < argc; optind++)
+    {
+      int err = parse_file (parser, argv[optind]);
+      if (err != 0)
+	parse_error (argv[optind], err);
+    }
+  bfparse (parser, 0);
+  if (optimize)
+    im_opt (&parser->ir, 1);
+
+  if (mem_stats)
+    fprintf (stderr, "%s: peak instruction storage %lu bytes\n",
+	     progname, (unsigned long) ir_peak ());
+  if (opt_stats && optimize)
+    opt_print_stats (stderr);
+}
+
+/* Parse, optimize and run the whole program in process, then quit. */
+void run_program (int argc, char **argv)
+{
+  parser_t parser;
+  whole_program (&parser, argc, argv);
+
+  if (run == 'i' || run == 'j')
+    interp_run (&parser.ir, run == 'j');
+  else if (jit_run (&parser.ir) != 0)
+    {
+      fprintf (stderr, "%s: --run needs x86-64 and executable memory\n",
+	       progname);
+      exit (EXIT_FAILURE);
+    }
+  parser_free (&parser);
+  exit (EXIT_SUCCESS);
+}
+
+/* Write the whole program as an executable, then quit. */
+void elf_program (int argc, char **argv)
+{
+  parser_t parser;
+  FILE *out = stdout;
+  whole_program (&parser, argc, argv);
+
+  if (strcmp (outfile, "-") != 0)
+    {
+      out = fopen (outfile, "wb");
+      if (out == NULL)
+	{
+	  fprintf (stderr, "%s: failed to open file %s - %s\n",
+		   progname, outfile, strerror (errno));
+	  exit (EXIT_FAILURE);
+	}
+    }
+  elf_write (out, &parser.ir);
+  if (out != stdout)
+    {
+      /* Executable, as far as the umask allows */
+      mode_t mask = umask (0);
+      umask (mask);
+      fchmod (fileno (out), 0777 & ~mask);
+      fclose (out);
+    }
+  parser_free (&parser);
+  exit (EXIT_SUCCESS);
+}
+
 void print_version ()
 {
   printf ("%s, version %s\n", PACKAGE_NAME, PACKAGE_VERSION);
@@ -34,20 +272,55 @@ void print_usage (int exit_stat)
 	  "at runtime\n");
   printf ("  -s, --static-mem      Memory size, number of cells (%d)\n",
 	  mem_size);
+  printf ("  -G, --guard-mem       Reserve a tape either side of the "
+	  "start, 16 GB or\n"
+	  "                        --mem-size cells, caught at the ends "
+	  "by guard pages\n");
   printf ("  -g, --mem-grow-rate   Dynamic memory grow rate (%d)\n",
 	  mem_grow_rate);
   printf ("  -o, --output          Select output file\n");
   printf ("  -O, --optimize        Optimize compiled code (C compiler)\n");
   printf ("  -d, --dump            Dump memory core after run\n");
+  printf ("  -F, --flush MODE      Buffer I/O in the program, flushing "
+	  "output when full\n"
+	  "                        (none), at newlines (line), or also "
+	  "before input\n"
+	  "                        (interactive). Input from a file is "
+	  "mapped.\n");
   printf ("  -C, --comments        Pass comments back out\n");
   printf ("  -H, --threads         Each supplied program gets a thread\n");
+  printf ("  -M, --mem-stats       Report peak compiler memory use\n");
+  printf ("  -S, --stream          Emit each top-level loop as it is read "
+	  "(bounded memory)\n");
+  printf ("  -E, --eval STEPS      Run the program at compile time until "
+	  "its first input\n"
+	  "                        or for STEPS instructions\n");
 #ifdef EN_COMPILE
   printf ("  -c, --compile         Send output to C compiler\n");
+#endif
+  printf ("  -e, --elf             Write an x86-64 Linux executable, "
+	  "without a C compiler\n");
+  printf ("  -r, --run             Run the program now, as x86-64 machine "
+	  "code\n");
+  printf ("  -i, --interpret       Run the program now, with the built-in "
+	  "interpreter\n");
+#ifdef EN_COMPILE
+  printf ("  -j, --tiered          Interpret the program now, compiling its "
+	  "hot loops\n"
+	  "                        in the background\n");
 #endif
   printf ("  -n, --no-optimize     Don't perform brainfuck optimization\n");
+  printf ("  -f<pass>, -fno-<pass> Turn an optimization pass on or off "
+	  "(see below)\n");
+  printf ("  -R, --opt-rounds N    Most optimization rounds (%d)\n",
+	  opt_rounds);
+  printf ("  -T, --opt-stats       Report what each optimization pass "
+	  "did\n");
   printf ("  -t, --cell-type       Cell type (see below)\n");
   printf ("  -V, --version         Print program version\n");
   printf ("  -h, --help            Print this help information\n");
+  printf ("\nOptimization Passes:\n\n");
+  opt_list (stdout);
   printf ("\nCell Types:\n\n");
   printf ("  char         Unsigned char   (0 to 256)\n");
   printf ("  short        Unsigned short  (probably 0 to 65536)\n");
@@ -70,6 +343,7 @@ int main (int argc, char **argv)
 	/* *INDENT-OFF* */
 	{"static-mem",    no_argument,       0, 's'},
 	{"bounds-err",    no_argument,       0, 'b'},
+	{"guard-mem",     no_argument,       0, 'G'},
 	{"mem-size",      required_argument, 0, 'm'},
 	{"mem-grow-rate", required_argument, 0, 'g'},
 	{"cell-type",     required_argument, 0, 't'},
@@ -78,10 +352,22 @@ int main (int argc, char **argv)
 	{"no-optimize",   no_argument,       0, 'n'},
 	{"threads",       no_argument,       0, 'H'},
 	{"comments",      no_argument,       0, 'C'},
+	{"mem-stats",     no_argument,       0, 'M'},
+	{"stream",        no_argument,       0, 'S'},
+	{"eval",          required_argument, 0, 'E'},
+	{"opt-rounds",    required_argument, 0, 'R'},
+	{"opt-stats",     no_argument,       0, 'T'},
 #ifdef EN_COMPILE
 	{"compile",       no_argument,       0, 'c'},
+#endif
+	{"elf",           no_argument,       0, 'e'},
+	{"run",           no_argument,       0, 'r'},
+	{"interpret",     no_argument,       0, 'i'},
+#ifdef EN_COMPILE
+	{"tiered",        no_argument,       0, 'j'},
 #endif
 	{"dump",          no_argument,       0, 'd'},
+	{"flush",         required_argument, 0, 'F'},
 	{"version",       no_argument,       0, 'V'},
 	{"help",          no_argument,       0, 'h'},
 	{0, 0, 0, 0}
@@ -91,7 +377,7 @@ int main (int argc, char **argv)
       /* getopt_long stores the option index here. */
       int option_index = 0;
       char c;
-      c = getopt_long (argc, argv, "sbm:g:t:o:OHncCdVh",
+      c = getopt_long (argc, argv, "sbGm:g:t:o:f:F:OHMSE:R:TnceirjCdVh",
 		       long_options, &option_index);
 
       /* Detect the end of the options. */
@@ -108,6 +394,10 @@ int main (int argc, char **argv)
 	  check_bounds = 1;
 	  break;
 
+	case 'G':		/* guard page memory */
+	  guard_mem = 1;
+	  break;
+
 	case 'C':		/* comments */
 	  pass_comments = 1;
 	  break;
@@ -116,8 +406,51 @@ int main (int argc, char **argv)
 	  bfthreads = 1;
 	  break;
 
+	case 'M':		/* memory statistics */
+	  mem_stats = 1;
+	  break;
+
+	case 'S':		/* streaming */
+	  stream = 1;
+	  break;
+
+	case 'E':		/* compile-time run */
+	  eval_steps = atol (optarg);
+	  if (eval_steps < 0)
+	    {
+	      fprintf (stderr, "%s: --eval argument must be >= 0\n",
+		       progname);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+
+	case 'f':		/* optimization pass */
+	  if (opt_set (optarg) != 0)
+	    {
+	      fprintf (stderr, "%s: unknown optimization pass %s\n",
+		       progname, strncmp (optarg, "no-", 3) == 0
+		       ? optarg + 3 : optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+
+	case 'R':		/* optimization rounds */
+	  opt_rounds = atoi (optarg);
+	  if (opt_rounds < 1)
+	    {
+	      fprintf (stderr, "%s: --opt-rounds argument must be >= 1\n",
+		       progname);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+
+	case 'T':		/* optimization statistics */
+	  opt_stats = 1;
+	  break;
+
 	case 'm':		/* memory size */
 	  mem_size = atoi (optarg);
+	  mem_size_set = 1;
 	  if (mem_size < 1)
 	    {
 	      fprintf (stderr,
@@ -155,6 +488,21 @@ int main (int argc, char **argv)
 	  break;
 #endif
 
+	case 'e':		/* executable */
+	  elf = 1;
+	  break;
+
+	case 'r':		/* run */
+	case 'i':		/* interpret */
+	  run = c;
+	  break;
+
+#ifdef EN_COMPILE
+	case 'j':		/* tiered */
+	  run = c;
+	  break;
+#endif
+
 	case 'O':		/* optimize */
 	  optimize_c = 1;
 	  break;
@@ -167,6 +515,20 @@ int main (int argc, char **argv)
 	  dump_core = 1;
 	  break;
 
+	case 'F':		/* flush policy */
+	  if (strcmp (optarg, "none") == 0)
+	    flush_mode = FLUSH_NONE;
+	  else if (strcmp (optarg, "line") == 0)
+	    flush_mode = FLUSH_LINE;
+	  else if (strcmp (optarg, "interactive") == 0)
+	    flush_mode = FLUSH_INTERACTIVE;
+	  else
+	    {
+	      fprintf (stderr, "%s: bad flush mode %s\n", progname, optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+
 	case 'V':		/* version */
 	  print_version ();
 	  exit (EXIT_SUCCESS);
@@ -186,6 +548,51 @@ int main (int argc, char **argv)
     }
 
   /* Set up for threads */
+  if (bfthreads && stream)
+    {
+      fprintf (stderr, "%s: --stream can't be used with --threads\n",
+	       progname);
+      exit (EXIT_FAILURE);
+    }
+  if (eval_steps > 0 && (bfthreads || stream || bfbignum))
+    {
+      fprintf (stderr, "%s: --eval can't be used with --threads, "
+	       "--stream or bignum cells\n", progname);
+      exit (EXIT_FAILURE);
+    }
+  if (run && (bfthreads || stream || bfbignum || eval_steps > 0
+	      || compile_output))
+    {
+      fprintf (stderr, "%s: --run, --interpret and --tiered can't be used "
+	       "with --threads, --stream, --eval, --compile or bignum "
+	       "cells\n", progname);
+      exit (EXIT_FAILURE);
+    }
+  if (elf && (bfthreads || stream || bfbignum || eval_steps > 0
+	      || compile_output || run))
+    {
+      fprintf (stderr, "%s: --elf can't be used with --threads, --stream, "
+	       "--eval, --compile, --run or bignum cells\n", progname);
+      exit (EXIT_FAILURE);
+    }
+  if (flush_mode != FLUSH_STDIO && (run || elf))
+    {
+      fprintf (stderr, "%s: --flush can't be used with --run, --interpret, "
+	       "--tiered or --elf\n", progname);
+      exit (EXIT_FAILURE);
+    }
+  if (guard_mem && (bfthreads || bfbignum || check_bounds || dump_core
+		    || run || elf))
+    {
+      fprintf (stderr, "%s: --guard-mem can't be used with --threads, "
+	       "--bounds-err, --dump, --run, --interpret, --tiered, --elf "
+	       "or bignum cells\n", progname);
+      exit (EXIT_FAILURE);
+    }
+  if (guard_mem)
+    dynamic_mem = 0;
+  if (guard_mem && mem_size_set)
+    guard_cells = mem_size;
   if (bfthreads)
     {
       bfthreads = argc - optind;
@@ -200,6 +607,11 @@ int main (int argc, char **argv)
       exit (EXIT_FAILURE);
     }
 
+  if (run)
+    run_program (argc, argv);
+  if (elf)
+    elf_program (argc, argv);
+
   /* Output file */
 #ifdef EN_COMPILE
   if (compile_output)
@@ -240,62 +652,72 @@ int main (int argc, char **argv)
 
   /* Produce the code */
   print_head ();
-  char c;
-  for (; optind < argc; optind++)
+  if (bfthreads)
     {
-      /* Open next file and keep parsing */
-      if (strcmp (argv[optind], "-") != 0)
+      /* Each program is parsed and optimized on its own, possibly in
+         parallel, and emitted in order. */
+      job_count = argc - optind;
+      jobs = (job_t *) bfmalloc (job_count * sizeof (job_t));
+      int i;
+      for (i = 0; i < job_count; i++)
 	{
-	  bfin = fopen (argv[optind], "r");
-	  if (bfin == NULL)
-	    {
-	      fprintf (stderr, "%s: failed to open file %s - %s\n",
-		       progname, argv[optind], strerror (errno));
-	      break;
-	    }
+	  jobs[i].name = argv[optind + i];
+	  jobs[i].done = 0;
+	  parser_init (&jobs[i].parser);
 	}
-      else
+      start_workers ();
+
+      for (i = 0; i < job_count; i++)
 	{
-	  bfin = stdin;
+	  job_t *job = wait_job (i);
+	  if (job->err != 0)
+	    parse_error (job->name, job->err);
+	  im_codegen (&job->parser.ir);
+	  parser_free (&job->parser);
 	}
-
-      lineno = 1;
-      while ((c = bfscan ()) != 0)
+      stop_workers ();
+      free (jobs);
+    }
+  else
+    {
+      /* All files make up one program */
+      parser_t parser;
+      parser_init (&parser);
+      if (stream)
 	{
-	  bfparse (c);
+	  parser.region = emit_region;
+	  codegen_begin ();
 	}
-
-      /* Mismatched brackets (bad indentation level) */
-      if (indent != 1)
+      for (; optind < argc; optind++)
 	{
-	  char *infile = argv[optind];
-	  if (strcmp (infile, "-") == 0)
-	    infile = "stdin";
-
-	  fprintf (stderr, "%s: mismatched brackets in %s\n",
-		   progname, infile);
-	  exit (EXIT_FAILURE);
+	  int err = parse_file (&parser, argv[optind]);
+	  if (err != 0)
+	    parse_error (argv[optind], err);
 	}
-
-      /* If threaded, start producing code */
-      if (bfthreads)
+      bfparse (&parser, 0);
+      if (stream)
+	{
+	  emit_region (&parser);
+	  codegen_end ();
+	}
+      else
 	{
-	  bfparse (0);
 	  if (optimize)
-	    im_opt (head);
-	  im_codegen (head);
-	  head = NULL;
+	    im_opt (&parser.ir, 1);
+	  if (eval_steps > 0)
+	    im_eval (&parser.ir, eval_steps);
+	  im_codegen (&parser.ir);
 	}
-    }
-  if (!bfthreads)
-    {
-      bfparse (0);
-      if (optimize)
-	im_opt (head);
-      im_codegen (head);
       print_tail ();
+      parser_free (&parser);
     }
 
+  if (mem_stats)
+    fprintf (stderr, "%s: peak instruction storage %lu bytes\n",
+	     progname, (unsigned long) ir_peak ());
+  if (opt_stats && optimize)
+    opt_print_stats (stderr);
+
   /* Close output file */
   if (!strcmp (outfile, "-") || compile_output)
     fclose (bfout);
@@ -372,22 +794,26 @@ int set_type (char *s)
   if (strcmp (s, "char") == 0)
     {
       bfstr_type = "unsigned char";
+      cell_bits = 8;
     }
   else if (strcmp (s, "short") == 0)
     {
       bfstr_type = "unsigned short";
+      cell_bits = 16;
     }
   else if (strcmp (s, "int") == 0)
     {
       bfstr_type = "unsigned int";
+      cell_bits = 32;
     }
 #if EN_BIGNUM
   else if (strcmp (s, "bignum") == 0)
     {
       bfstr_type = "mpz_t";
       bfbignum = 1;
-      bfstr_get = "mpz_set_ui (*%s, (unsigned long int) getchar ());\n";
-      bfstr_put = "putchar ((char) mpz_get_ui (*%s));\n";
+      cell_bits = 0;
+      bfstr_get = "mpz_set_ui (*%s, (unsigned long int) bf_getc ());\n";
+      bfstr_put = "bf_putc ((char) mpz_get_ui (*%s));\n";
       bfstr_loop =
 	"while ( !mpz_fits_sint_p (*%s) || mpz_get_ui (*%s) != 0) {\n";
     }
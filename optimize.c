@@ -0,0 +1,1279 @@
+#include "common.h"
+#include "parser.h"
+#include "codegen.h"
+
+#include <string.h>
+#include <limits.h>
+
+/* Replace a program with its rewritten version. The old version is
+   left for im_opt () to compare against and free. */
+static void ir_replace (ir_t * ir, ir_t * out)
+{
+  ir_link (out);
+  *ir = *out;
+}
+
+/* Scratch memory for passes, released after each pass */
+static arena_t opt_arena;
+
+/* Loop rewriting pass: replace each loop that rewrite () recognizes. */
+static void loop_pass (ir_t * ir, int (*rewrite) (ir_t *, ir_t *, int))
+{
+  ir_t out = { 0 };
+  int i;
+
+  for (i = 0; i < ir->count; i++)
+    {
+      if (ir->inst[i] == IM_LOOP && rewrite (&out, ir, i))
+	{
+	  i = ir->match[i];
+	  continue;
+	}
+      ir_copy (&out, ir, i);
+    }
+  ir_replace (ir, &out);
+}
+
+static void pass_copy (ir_t * ir)
+{
+  loop_pass (ir, loop_add_opt);
+}
+
+static void pass_nest (ir_t * ir)
+{
+  loop_pass (ir, loop_nest_opt);
+}
+
+static void pass_scan (ir_t * ir)
+{
+  loop_pass (ir, loop_scan_opt);
+}
+
+/* An optimization pass */
+typedef struct opt_pass_t
+{
+  char *name;			/* Name for -f and -fno- */
+  char *help;			/* Description */
+  void (*run) (ir_t * ir);
+  void (*run_at) (ir_t * ir, int start);	/* Or, told whether ir starts
+						   the program */
+  int threads;			/* Safe with --threads */
+  int enabled;
+
+  /* Statistics */
+  long runs;			/* Times run */
+  long changed;			/* Runs that changed the program */
+  long removed;			/* Instructions removed */
+  long added;			/* Instructions added */
+} opt_pass_t;
+
+/* All passes, in the order they run. Threads share cells through
+   cell_*(), which only reach the current cell, so passes that work
+   on other cells are off for them. */
+static opt_pass_t opt_passes[] = {
+  /* *INDENT-OFF* */
+  {"const", "Constant propagation and dead loop removal",
+   NULL, const_opt, 0, 1},
+  {"copy",  "Copy and multiply loops",
+   pass_copy, NULL, 1, 1},
+  {"nest",  "Nested counting loops",
+   pass_nest, NULL, 0, 1},
+  {"scan",  "Scan loops",
+   pass_scan, NULL, 1, 1},
+  {"fuse",  "Fuse clears and additions into stores",
+   set_fuse_opt, NULL, 1, 1},
+  {"sink",  "Cell offsets and pointer move sinking",
+   move_sink_opt, NULL, 0, 1},
+  {NULL}
+  /* *INDENT-ON* */
+};
+
+#define OPT_PASSES (sizeof (opt_passes) / sizeof (opt_passes[0]) - 1)
+
+int opt_rounds = 8;
+int opt_stats = 0;
+
+/* Enable or disable the pass named name, given as "pass" or
+   "no-pass". Returns 1 if there is no such pass. */
+int opt_set (char *name)
+{
+  int on = strncmp (name, "no-", 3) != 0;
+  if (!on)
+    name += 3;
+
+  opt_pass_t *pass;
+  for (pass = opt_passes; pass->name != NULL; pass++)
+    if (strcmp (pass->name, name) == 0)
+      {
+	pass->enabled = on;
+	return 0;
+      }
+  return 1;
+}
+
+/* Print the list of passes */
+void opt_list (FILE * out)
+{
+  opt_pass_t *pass;
+  for (pass = opt_passes; pass->name != NULL; pass++)
+    fprintf (out, "  %-12s %s\n", pass->name, pass->help);
+}
+
+/* Print the per-pass statistics */
+void opt_print_stats (FILE * out)
+{
+  opt_pass_t *pass;
+  fprintf (out, "%-8s %8s %8s %10s %10s\n", "pass", "runs", "changed",
+	   "removed", "added");
+  for (pass = opt_passes; pass->name != NULL; pass++)
+    fprintf (out, "%-8s %8ld %8ld %10ld %10ld\n", pass->name, pass->runs,
+	     pass->changed, pass->removed, pass->added);
+}
+
+/* Sort key for an instruction */
+static int inst_cmp (const void *a, const void *b)
+{
+  const long long *x = a, *y = b;
+  return *x < *y ? -1 : *x > *y;
+}
+
+/* Fingerprints of every instruction, sorted. */
+static long long *ir_keys (ir_t * ir)
+{
+  long long *key = (long long *) bfmalloc ((ir->count + 1)
+					   * sizeof (long long));
+  int i;
+  for (i = 0; i < ir->count; i++)
+    key[i] = ((long long) ir->inst[i] << 56)
+      ^ ((long long) (unsigned) ir->dst[i] << 36)
+      ^ ((long long) (unsigned) ir->src[i] << 16)
+      ^ ((long long) (unsigned) ir->src2[i] << 8)
+      ^ (unsigned) ir->val[i];
+  qsort (key, ir->count, sizeof (long long), inst_cmp);
+  return key;
+}
+
+/* What a pass did in one round */
+typedef struct opt_tally_t
+{
+  long changed;
+  long removed;
+  long added;
+} opt_tally_t;
+
+/* Count instructions removed and added by a pass, given sorted keys
+   of the program before it ran. */
+static void opt_count (opt_tally_t * t, long long *old, int nold, ir_t * ir)
+{
+  long long *key = ir_keys (ir);
+  int i = 0, j = 0, same = 0;
+  while (i < nold && j < ir->count)
+    {
+      if (old[i] == key[j])
+	same++, i++, j++;
+      else if (old[i] < key[j])
+	i++;
+      else
+	j++;
+    }
+  t->removed += nold - same;
+  t->added += ir->count - same;
+  free (key);
+}
+
+/* Whether two programs have the same instructions */
+static int ir_same (ir_t * a, ir_t * b)
+{
+  size_t n = a->count * sizeof (int);
+  return a->count == b->count
+    && memcmp (a->inst, b->inst, a->count) == 0
+    && memcmp (a->dst, b->dst, n) == 0
+    && memcmp (a->src, b->src, n) == 0 && memcmp (a->src2, b->src2, n) == 0
+    && memcmp (a->val, b->val, n) == 0;
+}
+
+/* Hash of a program's instructions, in order */
+static unsigned long long ir_hash (ir_t * ir)
+{
+  unsigned long long h = 14695981039346656037ull;
+  int i;
+  for (i = 0; i < ir->count; i++)
+    {
+      h = (h ^ ir->inst[i]) * 1099511628211ull;
+      h = (h ^ (unsigned) ir->dst[i]) * 1099511628211ull;
+      h = (h ^ (unsigned) ir->src[i]) * 1099511628211ull;
+      h = (h ^ (unsigned) ir->src2[i]) * 1099511628211ull;
+      h = (h ^ (unsigned) ir->val[i]) * 1099511628211ull;
+    }
+  return h ^ ir->count;
+}
+
+/* Optimize the intermediate code: run the enabled passes in order,
+   round after round until nothing changes, at most opt_rounds
+   times. start is set when ir begins the program, on a fresh tape. */
+void im_opt (ir_t * ir, int start)
+{
+  opt_tally_t tally[OPT_PASSES];
+  int round, changed = 1, n;
+
+  for (round = 0; round < opt_rounds && changed; round++)
+    {
+      /* Passes may undo each other's work, so a round that ends where
+         it started is also done, and what its passes did isn't
+         counted. */
+      unsigned long long hash = ir_hash (ir);
+      opt_pass_t *pass;
+      changed = 0;
+      memset (tally, 0, sizeof (tally));
+      for (n = 0; n < OPT_PASSES; n++)
+	{
+	  pass = &opt_passes[n];
+	  if (!pass->enabled || (bfthreads && !pass->threads))
+	    continue;
+
+	  ir_t old = *ir;
+	  long long *keys = opt_stats ? ir_keys (&old) : NULL;
+	  if (pass->run_at)
+	    pass->run_at (ir, start);
+	  else
+	    pass->run (ir);
+	  __sync_fetch_and_add (&pass->runs, 1);
+	  if (!ir_same (ir, &old))
+	    {
+	      changed = 1;
+	      tally[n].changed = 1;
+	    }
+	  if (keys != NULL)
+	    {
+	      opt_count (&tally[n], keys, old.count, ir);
+	      free (keys);
+	    }
+	  if (ir->inst != old.inst)
+	    ir_free (&old);
+	}
+      if (changed && ir_hash (ir) == hash)
+	changed = 0;
+      if (!changed)
+	continue;
+
+      for (n = 0; n < OPT_PASSES; n++)
+	{
+	  pass = &opt_passes[n];
+	  __sync_fetch_and_add (&pass->changed, tally[n].changed);
+	  __sync_fetch_and_add (&pass->removed, tally[n].removed);
+	  __sync_fetch_and_add (&pass->added, tally[n].added);
+	}
+    }
+}
+
+/* Most pending cell additions tracked in one block */
+#define SINK_PENDING 64
+
+/* Additions waiting to be emitted */
+typedef struct sink_t
+{
+  int count;
+  int off[SINK_PENDING];	/* Cell offset */
+  int add[SINK_PENDING];	/* Net change */
+  int line[SINK_PENDING];	/* Line of the first change */
+  int lo, hi;			/* Furthest the pointer has moved */
+} sink_t;
+
+/* Emit the pending addition at index n and drop it, keeping the rest
+   in order. */
+static void sink_emit (ir_t * out, sink_t * sk, int n)
+{
+  if (sk->add[n] > 0)
+    ir_add (out, IM_CINC, sk->off[n], sk->add[n], sk->line[n]);
+  else if (sk->add[n] < 0)
+    ir_add (out, IM_CDEC, sk->off[n], -sk->add[n], sk->line[n]);
+  sk->count--;
+  memmove (sk->off + n, sk->off + n + 1, (sk->count - n) * sizeof (int));
+  memmove (sk->add + n, sk->add + n + 1, (sk->count - n) * sizeof (int));
+  memmove (sk->line + n, sk->line + n + 1, (sk->count - n) * sizeof (int));
+}
+
+/* Emit the pending addition to cell off, if any. Unless keep is set
+   it is dropped instead, because the cell is about to be
+   overwritten. */
+static void sink_cell (ir_t * out, sink_t * sk, int off, int keep)
+{
+  int n;
+  for (n = 0; n < sk->count; n++)
+    if (sk->off[n] == off)
+      {
+	if (!keep)
+	  sk->add[n] = 0;
+	sink_emit (out, sk, n);
+	return;
+      }
+}
+
+/* Emit a pointer move by n */
+static void sink_move (ir_t * out, int n, int line)
+{
+  if (n > 0)
+    ir_add (out, IM_PRGHT, 0, n, line);
+  else if (n < 0)
+    ir_add (out, IM_PLEFT, 0, -n, line);
+}
+
+/* Emit everything pending, including the pointer move. With bounds
+   checking, the pointer is checked everywhere it went, so it is also
+   moved to the furthest places past both ends of the block. Cell
+   accesses there can't stand in for this, as later passes may drop
+   them. */
+static void sink_flush (ir_t * out, sink_t * sk, int *pos, int line)
+{
+  int at = 0;
+  while (sk->count > 0)
+    sink_emit (out, sk, 0);
+  if (check_bounds && sk->lo < *pos)
+    {
+      at = sk->lo;
+      sink_move (out, at, line);
+    }
+  if (check_bounds && sk->hi > *pos)
+    {
+      sink_move (out, sk->hi - at, line);
+      at = sk->hi;
+    }
+  sink_move (out, *pos - at, line);
+  *pos = 0;
+  sk->lo = sk->hi = 0;
+}
+
+/* Give every cell operation in straight-line code a constant offset
+   from the pointer at the start of the block, with a single pointer
+   move at the end. Additions to a cell are merged until something
+   else touches it, so +- and <> pairs cancel out. */
+void move_sink_opt (ir_t * ir)
+{
+  ir_t out = { 0 };
+  sink_t sk;
+  int i, c = 0, pos = 0;
+
+  sk.count = 0;
+  sk.lo = sk.hi = 0;
+  for (i = 0; i < ir->count; i++)
+    {
+      int inst = ir->inst[i];
+      int dst = pos + ir->dst[i];
+      int src = pos + ir->src[i];
+
+      /* Commented instructions stay in place, with their comment. */
+      if (c < ir->com_count && ir->com[c].inst == i)
+	{
+	  sink_flush (&out, &sk, &pos, ir->lineno[i]);
+	  ir_copy (&out, ir, i);
+	  c++;
+	  continue;
+	}
+
+      switch (inst)
+	{
+	case IM_PRGHT:
+	  pos += ir->src[i];
+	  if (pos > sk.hi)
+	    sk.hi = pos;
+	  break;
+
+	case IM_PLEFT:
+	  pos -= ir->src[i];
+	  if (pos < sk.lo)
+	    sk.lo = pos;
+	  break;
+
+	case IM_CINC:
+	case IM_CDEC:
+	  {
+	    int n, add = inst == IM_CINC ? ir->src[i] : -ir->src[i];
+	    for (n = 0; n < sk.count && sk.off[n] != dst; n++);
+	    if (n == sk.count)
+	      {
+		if (sk.count == SINK_PENDING)
+		  sink_emit (&out, &sk, 0);
+		n = sk.count++;
+		sk.off[n] = dst;
+		sk.add[n] = 0;
+		sk.line[n] = ir->lineno[i];
+	      }
+	    sk.add[n] += add;
+	  }
+	  break;
+
+	case IM_LOOP:
+	case IM_END:
+	case IM_SCAN:
+	  sink_flush (&out, &sk, &pos, ir->lineno[i]);
+	  ir_copy (&out, ir, i);
+	  break;
+
+	case IM_OUT:
+	  sink_cell (&out, &sk, dst, 1);
+	  ir_add (&out, inst, dst, 0, ir->lineno[i]);
+	  break;
+
+	case IM_IN:
+	case IM_CCLR:
+	case IM_CSET:
+	  sink_cell (&out, &sk, dst, 0);
+	  {
+	    int j = ir_add (&out, inst, dst, 0, ir->lineno[i]);
+	    out.val[j] = ir->val[i];
+	  }
+	  break;
+
+	case IM_CADD:
+	case IM_CMUL:
+	  sink_cell (&out, &sk, dst, 1);
+	  sink_cell (&out, &sk, src, 1);
+	  {
+	    int j = ir_add (&out, inst, dst, src, ir->lineno[i]);
+	    out.val[j] = ir->val[i];
+	  }
+	  break;
+
+	case IM_CPROD:
+	  sink_cell (&out, &sk, dst, 1);
+	  sink_cell (&out, &sk, src, 1);
+	  sink_cell (&out, &sk, pos + ir->src2[i], 1);
+	  {
+	    int j = ir_add (&out, inst, dst, src, ir->lineno[i]);
+	    out.src2[j] = pos + ir->src2[i];
+	    out.val[j] = ir->val[i];
+	  }
+	  break;
+
+	case IM_NOP:
+	  break;
+
+	default:
+	  ir_copy (&out, ir, i);
+	  break;
+	}
+    }
+  sink_flush (&out, &sk, &pos, ir->count ? ir->lineno[ir->count - 1] : 0);
+
+  ir_replace (ir, &out);
+}
+
+/* What const_opt () knows about a cell */
+#define CELL_DEFAULT 0		/* Not seen, zero if cf->zero */
+#define CELL_UNKNOWN 1		/* Value unknown */
+#define CELL_KNOWN   2		/* Value known and stored */
+#define CELL_DIRTY   3		/* Value known, store still pending */
+
+/* Cells tracked on each side of the origin */
+#define CONST_REACH 32768
+
+/* Known cell values. Cells are indexed from the origin, the pointer
+   when tracking last started, plus CONST_REACH. */
+typedef struct cfold_t
+{
+  ir_t *out;			/* Code being written */
+  int pos;			/* Pointer, relative to the origin */
+  int zero;			/* Cells not seen are zero */
+  int lo, hi;			/* Cells seen, lo <= cell < hi */
+  unsigned char *st;		/* Cell state */
+  long long *val;		/* Known value */
+  int *line;			/* Line that set the value */
+} cfold_t;
+
+/* Wrap a value to the cell width. Returns 0 if a bignum value doesn't
+   fit an instruction operand. */
+static int cell_wrap (long long *v)
+{
+  if (cell_bits == 0)
+    return *v >= -2147483647 && *v <= 2147483647;
+  *v &= (1LL << cell_bits) - 1;
+  return 1;
+}
+
+/* Multiply a value by k, wrapping to the cell width. Returns 0 if a
+   bignum product doesn't fit an instruction operand. */
+static int cell_mul (long long *v, long long k)
+{
+  if (cell_bits == 0)
+    {
+      if (*v > 2147483647 || *v < -2147483647
+	  || k > 2147483647 || k < -2147483647)
+	return 0;
+      *v *= k;
+    }
+  else
+    *v = (long long) ((unsigned long long) *v * (unsigned long long) k);
+  return cell_wrap (v);
+}
+
+/* Index of cell off from the pointer, or -1 if it's out of reach */
+static int cfold_cell (cfold_t * cf, int off)
+{
+  long long a = (long long) cf->pos + off + CONST_REACH;
+  if (a < 0 || a >= 2 * CONST_REACH)
+    return -1;
+  if (a < cf->lo)
+    cf->lo = a;
+  if (a >= cf->hi)
+    cf->hi = a + 1;
+  return a;
+}
+
+/* Whether cell a has a known value, returned in v */
+static int cfold_known (cfold_t * cf, int a, long long *v)
+{
+  if (a < 0)
+    return 0;
+  switch (cf->st[a])
+    {
+    case CELL_DEFAULT:
+      *v = 0;
+      return cf->zero;
+    case CELL_KNOWN:
+    case CELL_DIRTY:
+      *v = cf->val[a];
+      return 1;
+    }
+  return 0;
+}
+
+/* Give cell a a new state */
+static void cfold_set (cfold_t * cf, int a, int st, long long v, int line)
+{
+  if (a < 0)
+    return;
+  cf->st[a] = st;
+  cf->val[a] = v;
+  cf->line[a] = line;
+}
+
+/* Emit the pending store to cell a, if any */
+static void cfold_store (cfold_t * cf, int a)
+{
+  if (a < 0 || cf->st[a] != CELL_DIRTY)
+    return;
+  int off = a - CONST_REACH - cf->pos;
+  if (cf->val[a] == 0)
+    ir_add (cf->out, IM_CCLR, off, 0, cf->line[a]);
+  else
+    {
+      int j = ir_add (cf->out, IM_CSET, off, 0, cf->line[a]);
+      cf->out->val[j] = (int) cf->val[a];
+    }
+  cf->st[a] = CELL_KNOWN;
+}
+
+/* Emit all pending stores. They go ahead of a trailing pointer move,
+   where move sinking would put them. */
+static void cfold_flush (cfold_t * cf)
+{
+  ir_t *out = cf->out;
+  int a, last = out->count - 1, move = 0;
+  if (last >= 0 && (out->inst[last] == IM_PRGHT
+		    || out->inst[last] == IM_PLEFT)
+      && (out->com_count == 0 || out->com[out->com_count - 1].inst != last))
+    {
+      move = out->inst[last] == IM_PRGHT ? out->src[last] : -out->src[last];
+      out->count--;
+      cf->pos -= move;
+    }
+
+  for (a = cf->lo; a < cf->hi; a++)
+    cfold_store (cf, a);
+
+  if (move != 0)
+    {
+      ir_add (out, move > 0 ? IM_PRGHT : IM_PLEFT, 0,
+	      move > 0 ? move : -move, out->lineno[last]);
+      cf->pos += move;
+    }
+}
+
+/* Forget every cell and restart tracking at the pointer. Unseen cells
+   are zero if zero is set. */
+static void cfold_forget (cfold_t * cf, int zero)
+{
+  if (cf->lo < cf->hi)
+    memset (cf->st + cf->lo, CELL_DEFAULT, cf->hi - cf->lo);
+  cf->lo = 2 * CONST_REACH;
+  cf->hi = 0;
+  cf->pos = 0;
+  cf->zero = zero;
+}
+
+/* Add n to cell off, as a constant store when its value is known */
+static void cfold_add (cfold_t * cf, int off, long long n, int line)
+{
+  int a = cfold_cell (cf, off);
+  long long v;
+  if (cfold_known (cf, a, &v))
+    {
+      v += n;
+      if (cell_wrap (&v))
+	{
+	  cfold_set (cf, a, CELL_DIRTY, v, line);
+	  return;
+	}
+      cfold_store (cf, a);
+    }
+  if (n != 0)
+    ir_add (cf->out, n > 0 ? IM_CINC : IM_CDEC, off, n > 0 ? n : -n, line);
+  cfold_set (cf, a, CELL_UNKNOWN, 0, line);
+}
+
+/* Propagate known cell values forward through the program: the fresh
+   tape is all zero, and a loop leaves its cell zero. Changes to cells
+   with known values become stores, which are held back until
+   something reads the cell, so only the last one is emitted. Copies
+   from a known cell become plain additions, and clears of a zero cell
+   go away. */
+void const_opt (ir_t * ir, int start)
+{
+  ir_t out = { 0 };
+  cfold_t cf;
+  int i, c = 0;
+
+  cf.out = &out;
+  cf.st = arena_alloc (&opt_arena, 2 * CONST_REACH);
+  cf.val = arena_alloc (&opt_arena, 2 * CONST_REACH * sizeof (long long));
+  cf.line = arena_alloc (&opt_arena, 2 * CONST_REACH * sizeof (int));
+  memset (cf.st, CELL_DEFAULT, 2 * CONST_REACH);
+  cf.lo = cf.hi = 0;
+  cfold_forget (&cf, start);
+
+  for (i = 0; i < ir->count; i++)
+    {
+      int inst = ir->inst[i];
+      int line = ir->lineno[i];
+      int com = c < ir->com_count && ir->com[c].inst == i;
+      int a, b;
+      long long v, w;
+
+      /* Commented cell operations are kept as they are. */
+      if (com)
+	{
+	  c++;
+	  if (inst != IM_PRGHT && inst != IM_PLEFT && inst != IM_LOOP
+	      && inst != IM_END && inst != IM_SCAN)
+	    {
+	      cfold_flush (&cf);
+	      ir_copy (&out, ir, i);
+	      a = cfold_cell (&cf, ir->dst[i]);
+	      if (inst == IM_OUT || inst == IM_COUT || inst == IM_NOP)
+		continue;
+	      if (inst == IM_CCLR || inst == IM_CSET)
+		{
+		  w = inst == IM_CSET ? ir->val[i] : 0;
+		  if (cell_bits == 32)
+		    w = (unsigned) w;
+		  cfold_set (&cf, a, CELL_KNOWN, w, line);
+		}
+	      else if ((inst == IM_CINC || inst == IM_CDEC)
+		       && cfold_known (&cf, a, &v))
+		{
+		  v += inst == IM_CINC ? ir->src[i] : -(long long) ir->src[i];
+		  cfold_set (&cf, a, cell_wrap (&v) ? CELL_KNOWN
+			     : CELL_UNKNOWN, v, line);
+		}
+	      else
+		cfold_set (&cf, a, CELL_UNKNOWN, 0, line);
+	      continue;
+	    }
+	}
+
+      switch (inst)
+	{
+	case IM_NOP:
+	  continue;
+
+	case IM_COUT:
+	  ir_copy (&out, ir, i);
+	  continue;
+
+	case IM_PRGHT:
+	case IM_PLEFT:
+	  cf.pos += inst == IM_PRGHT ? ir->src[i] : -ir->src[i];
+	  ir_copy (&out, ir, i);
+	  /* Stay well inside the tracked cells */
+	  if (cf.pos > CONST_REACH / 2 || cf.pos < -CONST_REACH / 2)
+	    {
+	      cfold_flush (&cf);
+	      cfold_forget (&cf, 0);
+	    }
+	  continue;
+
+	case IM_CINC:
+	  cfold_add (&cf, ir->dst[i], ir->src[i], line);
+	  continue;
+
+	case IM_CDEC:
+	  cfold_add (&cf, ir->dst[i], -(long long) ir->src[i], line);
+	  continue;
+
+	case IM_CSET:
+	case IM_CCLR:
+	  a = cfold_cell (&cf, ir->dst[i]);
+	  w = inst == IM_CSET ? ir->val[i] : 0;
+	  if (cell_bits == 32)
+	    w = (unsigned) w;
+	  if (a < 0)
+	    ir_copy (&out, ir, i);
+	  else if (!cfold_known (&cf, a, &v) || v != w)
+	    cfold_set (&cf, a, CELL_DIRTY, w, line);
+	  continue;
+
+	case IM_IN:
+	  cfold_set (&cf, cfold_cell (&cf, ir->dst[i]), CELL_UNKNOWN, 0, line);
+	  ir_copy (&out, ir, i);
+	  continue;
+
+	case IM_OUT:
+	  a = cfold_cell (&cf, ir->dst[i]);
+	  if (cfold_known (&cf, a, &v))
+	    {
+	      /* Output the known value, the cell needn't be stored. */
+	      b = ir_add (&out, IM_COUT, 0, 0, line);
+	      out.val[b] = (v < 0 ? -v : v) & 0xff;
+	      continue;
+	    }
+	  cfold_store (&cf, a);
+	  ir_copy (&out, ir, i);
+	  continue;
+
+	case IM_CADD:
+	case IM_CMUL:
+	  a = cfold_cell (&cf, ir->dst[i]);
+	  b = cfold_cell (&cf, ir->src[i]);
+	  if (cfold_known (&cf, b, &w))
+	    {
+	      w *= inst == IM_CADD ? 1 : ir->val[i];
+	      if (cell_bits != 0)
+		{
+		  /* Add the smaller of w and its negation. */
+		  long long m = 1LL << cell_bits;
+		  cell_wrap (&w);
+		  if (w >= m / 2)
+		    w -= m;
+		}
+	      if (w >= -2147483647 && w <= 2147483647)
+		{
+		  cfold_add (&cf, ir->dst[i], w, line);
+		  continue;
+		}
+	    }
+	  cfold_store (&cf, a);
+	  cfold_store (&cf, b);
+	  ir_copy (&out, ir, i);
+	  cfold_set (&cf, a, CELL_UNKNOWN, 0, line);
+	  continue;
+
+	case IM_CPROD:
+	  a = cfold_cell (&cf, ir->dst[i]);
+	  b = cfold_cell (&cf, ir->src[i]);
+	  {
+	    /* A known factor of zero adds nothing, two known factors
+	       make a plain addition. */
+	    int b2 = cfold_cell (&cf, ir->src2[i]);
+	    int k1 = cfold_known (&cf, b, &v), k2 = cfold_known (&cf, b2, &w);
+	    if ((k1 && v == 0) || (k2 && w == 0))
+	      continue;
+	    if (k1 && k2 && cell_mul (&v, w) && cell_mul (&v, ir->val[i]))
+	      {
+		if (cell_bits != 0 && v >= (1LL << cell_bits) / 2)
+		  v -= 1LL << cell_bits;
+		if (v >= -2147483647 && v <= 2147483647)
+		  {
+		    cfold_add (&cf, ir->dst[i], v, line);
+		    continue;
+		  }
+	      }
+	    cfold_store (&cf, a);
+	    cfold_store (&cf, b);
+	    cfold_store (&cf, b2);
+	  }
+	  ir_copy (&out, ir, i);
+	  cfold_set (&cf, a, CELL_UNKNOWN, 0, line);
+	  continue;
+
+	case IM_LOOP:
+	  if (cfold_known (&cf, cfold_cell (&cf, 0), &v) && v == 0)
+	    {
+	      /* Dead loop: the body can never run. Its comments are
+	         kept on no-ops. */
+	      int end = ir->match[i], j;
+	      if (com)
+		{
+		  j = ir_add (&out, IM_NOP, 0, 0, ir->lineno[i]);
+		  ir_comment_copy (&out, j, ir, i);
+		}
+	      for (; c < ir->com_count && ir->com[c].inst <= end; c++)
+		{
+		  j = ir_add (&out, IM_NOP, 0, 0, ir->lineno[i]);
+		  ir_comment_copy (&out, j, ir, ir->com[c].inst);
+		}
+	      i = end;
+	      continue;
+	    }
+	  cfold_flush (&cf);
+	  ir_copy (&out, ir, i);
+	  cfold_forget (&cf, 0);
+	  break;
+
+	case IM_END:
+	case IM_SCAN:
+	  cfold_flush (&cf);
+	  ir_copy (&out, ir, i);
+	  cfold_forget (&cf, 0);
+	  cfold_set (&cf, cfold_cell (&cf, 0), CELL_KNOWN, 0, line);
+	  break;
+
+	default:
+	  cfold_flush (&cf);
+	  ir_copy (&out, ir, i);
+	  break;
+	}
+    }
+  cfold_flush (&cf);
+
+  arena_release (&opt_arena);
+  ir_replace (ir, &out);
+}
+
+/* Fuse a clear or store followed by additions to the same cell into
+   a single store. const_opt () does this and more, but doesn't run
+   with threads. */
+void set_fuse_opt (ir_t * ir)
+{
+  ir_t out = { 0 };
+  int i, c = 0;
+
+  for (i = 0; i < ir->count; i++)
+    {
+      int inst = ir->inst[i];
+      if (c < ir->com_count && ir->com[c].inst == i)
+	c++;
+      if (inst != IM_CCLR && inst != IM_CSET)
+	{
+	  ir_copy (&out, ir, i);
+	  continue;
+	}
+
+      long long v = inst == IM_CSET ? ir->val[i] : 0;
+      if (cell_bits == 32)
+	v = (unsigned) v;
+      int j = ir_add (&out, IM_CSET, ir->dst[i], 0, ir->lineno[i]);
+      if (ir->com_count > 0)
+	ir_comment_copy (&out, j, ir, i);
+
+      /* Take in the additions that follow. */
+      for (; i + 1 < ir->count; i++)
+	{
+	  int next = ir->inst[i + 1];
+	  long long w = v;
+	  if ((next != IM_CINC && next != IM_CDEC)
+	      || ir->dst[i + 1] != out.dst[j]
+	      || (c < ir->com_count && ir->com[c].inst == i + 1))
+	    break;
+	  w += next == IM_CINC ? ir->src[i + 1] : -(long long) ir->src[i + 1];
+	  /* Threads set bignums from unsigned values. */
+	  if (!cell_wrap (&w) || (bfthreads && w < 0))
+	    break;
+	  v = w;
+	}
+
+      if (v == 0)
+	out.inst[j] = IM_CCLR;
+      out.val[j] = (int) v;
+    }
+
+  ir_replace (ir, &out);
+}
+
+/* Most cells one copy loop may add to */
+#define LOOP_TARGETS 64
+
+/* Find special "copy" loops and unwrap them into out as one multiply
+   per target cell and a clear. Returns 0, without touching out, if
+   the loop at index loop isn't one. */
+int loop_add_opt (ir_t * out, ir_t * in, int loop)
+{
+  int end = in->match[loop];
+  int off[LOOP_TARGETS];	/* Target offsets */
+  int add[LOOP_TARGETS];	/* Net change per iteration */
+  int line[LOOP_TARGETS];	/* Line of the first change */
+  int ntarget = 0, bal = 0, i, t;
+
+  /* Tally the change to each cell. The loop must be innermost and
+     contain only +-<> */
+  for (i = loop + 1; i < end; i++)
+    {
+      int n;
+      switch (in->inst[i])
+	{
+	case IM_PRGHT:
+	  bal += in->src[i];
+	  continue;
+
+	case IM_PLEFT:
+	  bal -= in->src[i];
+	  continue;
+
+	case IM_CINC:
+	  n = in->src[i];
+	  break;
+
+	case IM_CDEC:
+	  n = -in->src[i];
+	  break;
+
+	case IM_NOP:
+	  continue;
+
+	default:
+	  /* Extra instruction type or inner loop, loop no good. */
+	  return 0;
+	}
+
+      int cell = bal + in->dst[i];
+      for (t = 0; t < ntarget && off[t] != cell; t++);
+      if (t == ntarget)
+	{
+	  if (ntarget == LOOP_TARGETS)
+	    return 0;
+	  off[t] = cell;
+	  add[t] = 0;
+	  line[t] = in->lineno[i];
+	  ntarget++;
+	}
+      add[t] += n;
+    }
+
+  if (bal != 0)
+    {
+      /* Unbalanced */
+      return 0;
+    }
+
+  /* The loop cell must step by one each time around. Counting up only
+     terminates on wrapping cells, and runs -x times. */
+  int step = 0, copies = 0;
+  for (t = 0; t < ntarget; t++)
+    {
+      if (off[t] == 0)
+	step = add[t];
+      else if (add[t] != 0)
+	copies++;
+    }
+  if (step != -1 && (step != 1 || bfbignum))
+    return 0;
+
+  /* Threads only get the clear, other cells may be shared. */
+  if (copies > 0 && bfthreads)
+    return 0;
+
+  /* Unwrap into multiplies and a clear. */
+  int first = out->count;
+  for (t = 0; t < ntarget; t++)
+    {
+      if (off[t] == 0 || add[t] == 0)
+	continue;
+      int k = add[t] * -step;
+      if (k == 1)
+	ir_add (out, IM_CADD, off[t], 0, line[t]);
+      else
+	{
+	  int j = ir_add (out, IM_CMUL, off[t], 0, line[t]);
+	  out->val[j] = k;
+	}
+    }
+  ir_add (out, IM_CCLR, 0, 0, in->lineno[loop]);
+  if (in->com_count > 0)
+    ir_comment_copy (out, first, in, loop);
+
+  return 1;
+}
+
+/* Find "scan" loops, whose body is a single pointer move, and replace
+   them with one IM_SCAN stepping by the move. Returns 0, without
+   touching out, if the loop at index loop isn't one. */
+int loop_scan_opt (ir_t * out, ir_t * in, int loop)
+{
+  int end = in->match[loop];
+  int step = 0, i;
+
+  /* Threads and bignums test cells through function calls. */
+  if (bfthreads || bfbignum)
+    return 0;
+
+  for (i = loop + 1; i < end; i++)
+    {
+      switch (in->inst[i])
+	{
+	case IM_PRGHT:
+	  step += in->src[i];
+	  continue;
+
+	case IM_PLEFT:
+	  step -= in->src[i];
+	  continue;
+
+	case IM_NOP:
+	  continue;
+
+	default:
+	  return 0;
+	}
+    }
+
+  /* A loop that doesn't move never ends once entered; leave it be. */
+  if (step == 0)
+    return 0;
+
+  int j = ir_add (out, IM_SCAN, 0, step, in->lineno[loop]);
+  if (in->com_count > 0)
+    ir_comment_copy (out, j, in, loop);
+
+  return 1;
+}
+
+/* One pass through a nest body, as affine functions: the value of
+   each cell at the end is a constant plus a sum of multiples of the
+   cells' values at the start. */
+typedef struct nest_t
+{
+  int n;			/* Cells tracked */
+  int off[LOOP_TARGETS];	/* Cell offset */
+  /* Coefficient of each starting value, then the constant */
+  long long co[LOOP_TARGETS][LOOP_TARGETS + 1];
+} nest_t;
+
+#define NEST_CONST LOOP_TARGETS
+
+/* Index of cell off, or -1 if there are too many cells */
+static int nest_cell (nest_t * ns, int off)
+{
+  int x, y;
+  for (x = 0; x < ns->n; x++)
+    if (ns->off[x] == off)
+      return x;
+  if (ns->n == LOOP_TARGETS)
+    return -1;
+  x = ns->n++;
+  ns->off[x] = off;
+  for (y = 0; y < x; y++)
+    ns->co[y][x] = 0;
+  memset (ns->co[x], 0, sizeof (ns->co[x]));
+  ns->co[x][x] = 1;
+  return x;
+}
+
+/* Add k times row s to row x. Returns 0 if a bignum coefficient gets
+   too big. */
+static int nest_addmul (nest_t * ns, int x, int s, long long k)
+{
+  long long row[LOOP_TARGETS + 1];
+  int y;
+  memcpy (row, ns->co[s], sizeof (row));
+  for (y = 0; y <= NEST_CONST; y++)
+    {
+      if (y == ns->n)
+	y = NEST_CONST;
+      long long v = row[y];
+      if (v == 0)
+	continue;
+      if (!cell_mul (&v, k))
+	return 0;
+      v += ns->co[x][y];
+      if (!cell_wrap (&v))
+	return 0;
+      ns->co[x][y] = v;
+    }
+  return 1;
+}
+
+/* Emit the cell operation dst += src * src2 * k, or dst += src * k if
+   src2 is INT_MIN. k is wrapped to the cell width. */
+static void nest_emit (ir_t * out, int dst, int src, int src2, long long k,
+		       int line)
+{
+  int j;
+  if (cell_bits != 0 && k >= (1LL << cell_bits) / 2)
+    k -= 1LL << cell_bits;
+  if (src2 == INT_MIN)
+    {
+      j = ir_add (out, k == 1 ? IM_CADD : IM_CMUL, dst, src, line);
+      out->val[j] = k;
+      return;
+    }
+  j = ir_add (out, IM_CPROD, dst, src, line);
+  out->src2[j] = src2;
+  out->val[j] = k;
+}
+
+/* Find counting loops whose body, inner copy loops already unwrapped,
+   adds the same amount to some cells each time around, and replace
+   them with products of the loop count. Cells the body sets to a
+   constant hold it after the first time around, so when there are
+   any, the first pass through the body is kept and the loop turned
+   into one that ends with a clear, running at most once. Returns 0,
+   without touching out, if the loop at index loop isn't one. */
+int loop_nest_opt (ir_t * out, ir_t * in, int loop)
+{
+  int end = in->match[loop];
+  nest_t ns;
+  int bal = 0, i, x, y, d, s;
+
+  /* Run the body symbolically. It must be straight-line code. The
+     loop cell is cell 0. */
+  ns.n = 0;
+  nest_cell (&ns, 0);
+  for (i = loop + 1; i < end; i++)
+    {
+      int inst = in->inst[i];
+      switch (inst)
+	{
+	case IM_PRGHT:
+	  bal += in->src[i];
+	  continue;
+
+	case IM_PLEFT:
+	  bal -= in->src[i];
+	  continue;
+
+	case IM_NOP:
+	  continue;
+
+	case IM_CINC:
+	case IM_CDEC:
+	case IM_CCLR:
+	case IM_CSET:
+	case IM_CADD:
+	case IM_CMUL:
+	  break;
+
+	default:
+	  return 0;
+	}
+
+      if ((d = nest_cell (&ns, bal + in->dst[i])) < 0)
+	return 0;
+      long long *co = ns.co[d];
+      long long v;
+      switch (inst)
+	{
+	case IM_CINC:
+	case IM_CDEC:
+	  v = co[NEST_CONST] + (inst == IM_CINC ? in->src[i]
+				: -(long long) in->src[i]);
+	  if (!cell_wrap (&v))
+	    return 0;
+	  co[NEST_CONST] = v;
+	  break;
+
+	case IM_CCLR:
+	case IM_CSET:
+	  v = inst == IM_CSET ? in->val[i] : 0;
+	  if (cell_bits == 32)
+	    v = (unsigned) v;
+	  memset (co, 0, sizeof (ns.co[d]));
+	  co[NEST_CONST] = v;
+	  break;
+
+	default:
+	  if ((s = nest_cell (&ns, bal + in->src[i])) < 0
+	      || !nest_addmul (&ns, d, s, inst == IM_CADD ? 1 : in->val[i]))
+	    return 0;
+	  break;
+	}
+    }
+  if (bal != 0)
+    return 0;
+
+  /* Cells set to a constant, and whether they're all zero */
+  char fixed[LOOP_TARGETS];
+  int nfixed = 0;
+  for (x = 0; x < ns.n; x++)
+    {
+      for (y = 0; y < ns.n && ns.co[x][y] == 0; y++);
+      fixed[x] = y == ns.n;
+      nfixed += fixed[x];
+    }
+
+  /* After the first time around, the constants stand in for those
+     cells. */
+  if (nfixed > 0)
+    for (x = 0; x < ns.n; x++)
+      for (y = 0; y < ns.n; y++)
+	if (!fixed[x] && fixed[y] && ns.co[x][y] != 0)
+	  {
+	    long long v = ns.co[y][NEST_CONST];
+	    if (!cell_mul (&v, ns.co[x][y]))
+	      return 0;
+	    v += ns.co[x][NEST_CONST];
+	    if (!cell_wrap (&v))
+	      return 0;
+	    ns.co[x][NEST_CONST] = v;
+	    ns.co[x][y] = 0;
+	  }
+
+  /* The loop cell must step by one each time around, as for copy
+     loops. Every other cell must keep its value or gain an amount
+     that depends only on cells that keep theirs. */
+  long long step = ns.co[0][NEST_CONST];
+  if (cell_bits != 0 && step == (1LL << cell_bits) - 1)
+    step = -1;
+  if (fixed[0] || ns.co[0][0] != 1
+      || (step != -1 && (step != 1 || bfbignum)))
+    return 0;
+  for (y = 1; y < ns.n; y++)
+    if (ns.co[0][y] != 0)
+      return 0;
+  char same[LOOP_TARGETS];
+  for (x = 0; x < ns.n; x++)
+    {
+      same[x] = !fixed[x] && ns.co[x][NEST_CONST] == 0;
+      for (y = 0; y < ns.n; y++)
+	if (ns.co[x][y] != (x == y))
+	  same[x] = 0;
+    }
+  for (x = 1; x < ns.n; x++)
+    {
+      if (fixed[x] || same[x])
+	continue;
+      if (ns.co[x][x] != 1)
+	return 0;
+      for (y = 0; y < ns.n; y++)
+	if (y != x && ns.co[x][y] != 0 && (y == 0 || !same[y]))
+	  return 0;
+    }
+
+  /* The products use the count of the passes left, which is the loop
+     cell times -step. */
+  int first = out->count, line = in->lineno[loop];
+  if (nfixed > 0)
+    for (i = loop; i < end; i++)
+      ir_copy (out, in, i);
+  for (x = 1; x < ns.n; x++)
+    {
+      if (fixed[x] || same[x])
+	continue;
+      for (y = 1; y <= NEST_CONST; y++)
+	{
+	  if (y == ns.n)
+	    y = NEST_CONST;
+	  long long k = ns.co[x][y];
+	  if (y == x || k == 0)
+	    continue;
+	  cell_mul (&k, -step);
+	  nest_emit (out, ns.off[x], 0, y == NEST_CONST ? INT_MIN : ns.off[y],
+		     k, line);
+	}
+    }
+  ir_add (out, IM_CCLR, 0, 0, line);
+  if (nfixed > 0)
+    ir_copy (out, in, end);
+  else if (in->com_count > 0)
+    ir_comment_copy (out, first, in, loop);
+
+  return 1;
+}
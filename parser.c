@@ -3,352 +3,479 @@
 #include "codegen.h"
 
 #include <string.h>
+#ifdef HAVE_MMAP
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
 
-int lineno;			/* Current scanner line number. */
-
-inst_t *head = NULL;		/* First instruction */
-inst_t *tail = NULL;		/* Last instruction */
-
-char *com_buf;
-char *com_ptr;
-int com_buf_size = 0;
+/* Read size for unmappable input */
+#define SCAN_BLOCK (1 << 16)
 
 /* Create new instruction. */
-inst_t *im_create (inst_t * inst);
+static int im_create (parser_t * p, int inst, int src);
 
 /* Parser function */
-void bfparse (char c)
+void bfparse (parser_t * p, char c)
 {
-  /* Mode is used to optimize the pointer operations +-<> */
-  static char mode = 0;
-  static int mode_count = 0;
-  static int loopnow = 0;
-  static int nextloop = 0;
-  int no_inst;
-
-  /* Initialize */
-  if (head == NULL)
+  if (c == p->mode && c != 0)
     {
-      inst_t newhead;
-      newhead.inst = IM_NOP;
-      newhead.ret = NULL;
-      head = im_create (&newhead);
-      tail = head;
+      p->mode_count++;
+      return;
     }
 
-  /* Modes */
-  no_inst = 0;
-  loopnow = nextloop;
-  nextloop = 0;
-
-  inst_t cinst;			/* Current instruction. */
-  cinst.inst = IM_NOP;
-  cinst.ret = tail->ret;
+  /* End current p->mode */
+  switch (p->mode)
+    {
+    case '+':
+      im_create (p, IM_CINC, p->mode_count);
+      break;
+    case '-':
+      im_create (p, IM_CDEC, p->mode_count);
+      break;
+    case '<':
+      im_create (p, IM_PLEFT, p->mode_count);
+      break;
+    case '>':
+      im_create (p, IM_PRGHT, p->mode_count);
+      break;
+    }
+  p->mode = 0;
 
-  if (c == mode)
-    mode_count++;
-  else
+  /* Parse new character outside of p->mode */
+  switch (c)
     {
-      /* End current mode */
-      if (mode)
+    case '+':
+    case '-':
+    case '<':
+    case '>':
+      p->mode = c;
+      p->mode_count = 1;
+      break;
+    case ',':
+      im_create (p, IM_IN, 0);
+      break;
+    case '.':
+      im_create (p, IM_OUT, 0);
+      break;
+    case '[':
+      if (p->loop_depth == p->loop_size)
 	{
-	  switch (mode)
-	    {
-	    case '+':
-	      cinst.inst = IM_CINC;
-	      cinst.src = mode_count;
-	      cinst.ret = tail->ret;
-	      break;
-	    case '-':
-	      cinst.inst = IM_CDEC;
-	      cinst.src = mode_count;
-	      cinst.ret = tail->ret;
-	      break;
-	    case '<':
-	      cinst.inst = IM_PLEFT;
-	      cinst.src = mode_count;
-	      cinst.ret = tail->ret;
-	      break;
-	    case '>':
-	      cinst.inst = IM_PRGHT;
-	      cinst.src = mode_count;
-	      cinst.ret = tail->ret;
-	      break;
-	    }
-	  mode = -1;
-
-	  /* Add this instruction. */
-	  if (!loopnow)
-	    {
-	      tail->next = im_create (&cinst);
-	      tail = tail->next;
-	    }
-	  else
-	    {
-	      inst_t *old_tail = tail;
-	      tail->loop = im_create (&cinst);
-	      tail = tail->loop;
-	      tail->ret = old_tail;
-	    }
-
-	  /* Reset */
-	  loopnow = 0;
-	  nextloop = 0;
-	  cinst.inst = IM_NOP;
-	  cinst.ret = NULL;
+	  p->loop_size = p->loop_size ? p->loop_size * 2 : 64;
+	  p->loop_stack = (int *) bfrealloc (p->loop_stack,
+					  p->loop_size * sizeof (int));
 	}
-
-      /* Parse new character outside of mode */
-      switch (c)
+      p->loop_stack[p->loop_depth++] = im_create (p, IM_LOOP, 0);
+      break;
+    case ']':
+      if (p->loop_depth == 0)
 	{
-	case '+':
-	case '-':
-	case '<':
-	case '>':
-	  mode = c;
-	  mode_count = 1;
-	  no_inst = 1;
-	  break;
-	case ',':
-	  cinst.inst = IM_IN;
-	  cinst.ret = tail->ret;
-	  break;
-	case '.':
-	  cinst.inst = IM_OUT;
-	  cinst.ret = tail->ret;
-	  break;
-	case '[':
-	  cinst.inst = IM_NOP;
-	  cinst.ret = tail->ret;
-	  nextloop = 1;
-	  indent++;
-	  break;
-	case ']':
-	  tail = tail->ret;
-	  no_inst = 1;
-	  indent--;
-	  break;
-	default:
-	  /* Control reaches here on last run */
-	  no_inst = 1;
+	  p->loop_bad = 1;
 	  break;
 	}
+      /* Comments stay pending for the next real instruction. */
+      {
+	int open = p->loop_stack[--p->loop_depth];
+	int close = ir_add (&p->ir, IM_END, 0, 0, p->lineno);
+	p->ir.match[open] = close;
+	p->ir.match[close] = open;
+      }
+      break;
+    default:
+      /* Control reaches here on last run. A comment after the last
+         command is kept on an instruction of its own. */
+      if (c == 0 && p->com_ptr != p->com_buf)
+	im_create (p, IM_NOP, 0);
+      break;
     }
 
-  if (no_inst)
+  /* Hand off finished top-level code */
+  if (p->region != NULL && p->loop_depth == 0 && p->ir.count > 0
+      && (c == ']' || p->ir.count >= REGION_MAX))
+    p->region (p);
+}
+
+/* Number of open loops, or -1 after an unmatched ] */
+int bfparse_depth (parser_t * p)
+{
+  if (p->loop_bad)
+    return -1;
+  return p->loop_depth;
+}
+
+/* Scanner lookup table: non-zero for the eight BF commands. */
+static const char scan_cmd[256] = {
+  ['+'] = 1,['-'] = 1,['<'] = 1,['>'] = 1,
+  ['.'] = 1,[','] = 1,['['] = 1,[']'] = 1
+};
+
+#ifdef __SSE2__
+/* Classify 16 bytes at once: bit i is set when p[i] is a command. */
+static unsigned scan_mask16 (const char *p)
+{
+  __m128i v = _mm_loadu_si128 ((const __m128i *) p);
+  __m128i m;
+  m = _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('+')),
+		    _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('-')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('<')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('>')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('.')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 (',')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('[')));
+  m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, _mm_set1_epi8 (']')));
+  return _mm_movemask_epi8 (m);
+}
+#endif
+
+/* Length of the leading run of non-command bytes. */
+static size_t scan_skip (const char *p, size_t n)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16)
     {
-      nextloop = loopnow;
-      return;
+      unsigned m = scan_mask16 (p + i);
+      if (m)
+	return i + __builtin_ctz (m);
     }
+#endif
+  while (i < n && !scan_cmd[(unsigned char) p[i]])
+    i++;
+  return i;
+}
 
-  if (!loopnow)
+/* Length of the leading run of command bytes. */
+static size_t scan_run (const char *p, size_t n)
+{
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16)
     {
-      tail->next = im_create (&cinst);
-      tail = tail->next;
+      unsigned m = ~scan_mask16 (p + i) & 0xffff;
+      if (m)
+	return i + __builtin_ctz (m);
     }
-  else
+#endif
+  while (i < n && scan_cmd[(unsigned char) p[i]])
+    i++;
+  return i;
+}
+
+/* Count the newlines in a block. */
+static int scan_lines (const char *p, size_t n)
+{
+  size_t i = 0;
+  int count = 0;
+#ifdef __SSE2__
+  __m128i nl = _mm_set1_epi8 ('\n');
+  for (; i + 16 <= n; i += 16)
     {
-      inst_t *old_tail = tail;
-      tail->loop = im_create (&cinst);
-      tail = tail->loop;
-      tail->ret = old_tail;
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+      count += __builtin_popcount (_mm_movemask_epi8
+				   (_mm_cmpeq_epi8 (v, nl)));
     }
+#endif
+  for (; i < n; i++)
+    count += p[i] == '\n';
+  return count;
 }
 
-/* Read in only valid BF characters +-<>,.[] */
-char bfscan ()
+/* Append skipped bytes to the comment string. Leading whitespace is
+   dropped. */
+static void com_append (parser_t * p, const char *s, size_t n)
 {
-  static int lineinc = 0;
-  char c = 0;
+  if (p->com_ptr == p->com_buf)
+    while (n > 0 && *s <= 32)
+      {
+	s++;
+	n--;
+      }
+  if (n == 0)
+    return;
+
+  size_t offset = p->com_ptr - p->com_buf;
+  if (p->com_buf_size == 0)
+    p->com_buf_size = 1024;
+  while (offset + n + 1 >= p->com_buf_size)
+    p->com_buf_size *= 2;
+  p->com_buf = (char *) bfrealloc (p->com_buf, p->com_buf_size);
+  p->com_ptr = p->com_buf + offset;
+
+  memcpy (p->com_ptr, s, n);
+  p->com_ptr += n;
+  *p->com_ptr = 0;
+}
 
-  while (c == 0 && !feof (bfin))
-    {
-      c = getc (bfin);
-      switch (c)
-	{
-	case '+':
-	case '-':
-	case '<':
-	case '>':
-	case '.':
-	case ',':
-	case '[':
-	case ']':
-	  lineno += lineinc;
-	  lineinc = 0;
-	  break;
-	case 10:		/* newline */
-	  lineinc = 1;
-	default:
-	  /* Build comment string */
-	  if (com_ptr - com_buf != 0 || c > 32)
-	    {
-	      if (com_buf_size == 0)
-		{
-		  com_buf_size = 1024;
-		  com_buf = (char *) bfmalloc (com_buf_size);
-		  com_ptr = com_buf;
-		}
-	      if (com_ptr - com_buf + 2 >= com_buf_size)
-		{
-		  size_t offset = com_ptr - com_buf;
-		  com_buf_size *= 2;
-		  com_buf = (char *) realloc ((void *) com_buf, com_buf_size);
-		  com_ptr = com_buf + offset;
-		}
-	      *com_ptr = c;
-	      com_ptr++;
-	      *com_ptr = 0;
-	    }
-	  c = 0;
-	  break;
-	}
-    }
-  return c;
+/* Refill the scan block. Returns 0 at end of input. */
+static int scan_fill (parser_t * p)
+{
+  if (p->scan_mapped)
+    return 0;
+  p->scan_pos = 0;
+  p->scan_len = fread (p->scan_buf, 1, SCAN_BLOCK, p->in);
+  return p->scan_len > 0;
 }
 
-inst_t *im_create (inst_t * inst)
+/* Prepare to scan a new input file. Regular files are mapped
+   whole. */
+void bfscan_open (parser_t * p, FILE * in)
 {
-  /* Copy it */
-  inst_t *newinst = (inst_t *) bfmalloc (sizeof (inst_t));
-  memcpy (newinst, inst, sizeof (inst_t));
-  newinst->loop = NULL;
-  newinst->next = NULL;
-  newinst->lineno = lineno;
-  if (com_ptr - com_buf > 0)
+  p->in = in;
+  p->lineno = 1;
+  p->scan_pos = p->scan_len = 0;
+  p->scan_lineinc = 0;
+  p->scan_mapped = 0;
+#ifdef HAVE_MMAP
+  struct stat st;
+  if (fstat (fileno (in), &st) == 0 && S_ISREG (st.st_mode)
+      && st.st_size > 0 && ftell (in) == 0)
     {
-      /* Filter comment */
-      char *i;
-      for (i = com_ptr; i > com_buf; i--)
+      void *map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			fileno (in), 0);
+      if (map != MAP_FAILED)
 	{
-	  if (*i <= 32)
-	    *i = 0;
-	  else
-	    break;
+	  madvise (map, st.st_size, MADV_SEQUENTIAL);
+	  p->scan_buf = (char *) map;
+	  p->scan_len = st.st_size;
+	  p->scan_mapped = 1;
+	  return;
 	}
-
-      newinst->comment = strdup (com_buf);
-      com_ptr = com_buf;
     }
-  else
-    newinst->comment = NULL;
-
-  return newinst;
+#endif
+  if (p->scan_block == NULL)
+    p->scan_block = (char *) bfmalloc (SCAN_BLOCK);
+  p->scan_buf = p->scan_block;
 }
 
-/* Optimize the intermediate code */
-void im_opt (inst_t * head)
+/* Release the current input. */
+void bfscan_close (parser_t * p)
 {
-  inst_t *ii = head;
+#ifdef HAVE_MMAP
+  if (p->scan_mapped)
+    munmap (p->scan_buf, p->scan_len);
+#endif
+  p->scan_mapped = 0;
+  p->scan_buf = NULL;
+  p->scan_pos = p->scan_len = 0;
+  p->in = NULL;
+}
 
-  while (ii != NULL)
+/* Read in only valid BF characters +-<>,.[] and return them as runs
+   of consecutive commands. Everything else goes to the comment
+   buffer. Returns 0 at end of input. */
+size_t bfscan (parser_t * p, char **run)
+{
+  while (1)
     {
-      if (ii->loop)
+      if (p->scan_pos == p->scan_len && !scan_fill (p))
+	return 0;
+
+      char *s = p->scan_buf + p->scan_pos;
+      size_t n = p->scan_len - p->scan_pos;
+      size_t gap = scan_skip (s, n);
+      if (gap > 0)
 	{
-	  /* Run optmization on loop. */
-	  inst_t *rep;
-	  rep = loop_add_opt (ii->loop);
-	  if (rep)
-	    {
-	      ii->next = rep;
-	      ii->loop = NULL;
-	    }
+	  p->scan_lineinc += scan_lines (s, gap);
+	  if (pass_comments)
+	    com_append (p, s, gap);
+	  p->scan_pos += gap;
+	  if (gap == n)
+	    continue;
 	}
 
-      ii = ii->next;
+      size_t len = scan_run (s + gap, n - gap);
+      p->lineno += p->scan_lineinc;
+      p->scan_lineinc = 0;
+      p->scan_pos += len;
+      *run = s + gap;
+      return len;
     }
 }
 
-/* Find special "copy" loops and unwrap them. */
-inst_t *loop_add_opt (inst_t * loopinst)
+/* Set up an empty parser. */
+void parser_init (parser_t * p)
+{
+  memset (p, 0, sizeof (parser_t));
+}
+
+/* Release everything held by a parser, including its program. */
+void parser_free (parser_t * p)
+{
+  ir_free (&p->ir);
+  free (p->loop_stack);
+  free (p->com_buf);
+  free (p->scan_block);
+  memset (p, 0, sizeof (parser_t));
+}
+
+static int im_create (parser_t * p, int inst, int src)
 {
-  inst_t newinst;
-  inst_t *head, *tail;
-  head = (inst_t *) bfmalloc (sizeof (inst_t));
-  head->next = NULL;
-  tail = head;
-
-  /* Is loop balanced? */
-  int bal = 0, badloop = 0;
-  inst_t *ii = loopinst;
-  while (ii != NULL)
+  int i = ir_add (&p->ir, inst, 0, src, p->lineno);
+  if (p->com_ptr - p->com_buf > 0)
     {
-      if (ii->loop != NULL)
-	{
-	  badloop = 1;
-
-	  /* This is not the innermost loop. */
-	  inst_t *optinst = loop_add_opt (ii->loop);
-	  if (optinst != NULL)
-	    {
-	      ii->loop = NULL;
-	      ii->next = optinst;
-	    }
-	}
+      /* Filter comment: drop trailing whitespace, stop at a NUL */
+      size_t len = p->com_ptr - p->com_buf;
+      while (len > 1 && p->com_buf[len - 1] <= 32)
+	len--;
+      len = strnlen (p->com_buf, len);
+
+      ir_comment_add (&p->ir, i, p->com_buf, len);
+      p->com_ptr = p->com_buf;
+    }
 
-      switch (ii->inst)
-	{
-	case IM_PRGHT:
-	  bal += ii->src;
-	  break;
+  return i;
+}
 
-	case IM_PLEFT:
-	  bal -= ii->src;
-	  break;
+/* Bytes per instruction slot */
+#define IR_SLOT (sizeof (unsigned char) + 6 * sizeof (int))
 
-	case IM_CINC:
-	  if (bal == 0)
-	    badloop = 1;
-	  else
-	    {
-	      int i;
-	      for (i = 0; i < ii->src; i++)
-		{
-		  newinst.inst = IM_CADD;
-		  newinst.ret = loopinst->ret->ret;
-		  newinst.dst = bal;
-		  newinst.src = 0;
-		  lineno = ii->lineno;
-		  tail->next = im_create (&newinst);
-		  tail = tail->next;
-		}
-	    }
-	  break;
+static size_t ir_live = 0;	/* Bytes held by all programs */
+static size_t ir_high = 0;	/* High water mark of ir_live */
 
-	case IM_CDEC:
-	  if (bal != 0)
-	    badloop = 1;
-	  break;
+/* Track instruction storage. Programs may be built on several
+   threads at once. */
+static void ir_account (size_t add, size_t sub)
+{
+  size_t live = __sync_add_and_fetch (&ir_live, add - sub);
+  size_t high = ir_high;
+  while (live > high)
+    {
+      size_t seen = __sync_val_compare_and_swap (&ir_high, high, live);
+      if (seen == high)
+	break;
+      high = seen;
+    }
+}
 
-	case IM_NOP:
-	  break;
+/* Make room for n more instructions. */
+static void ir_grow (ir_t * ir, int n)
+{
+  if (ir->count + n <= ir->size)
+    return;
+  size_t old = ir->size * IR_SLOT;
+  while (ir->count + n > ir->size)
+    ir->size = ir->size ? ir->size * 2 : 1024;
+  ir->inst = (unsigned char *) bfrealloc (ir->inst, ir->size);
+  ir->dst = (int *) bfrealloc (ir->dst, ir->size * sizeof (int));
+  ir->src = (int *) bfrealloc (ir->src, ir->size * sizeof (int));
+  ir->src2 = (int *) bfrealloc (ir->src2, ir->size * sizeof (int));
+  ir->val = (int *) bfrealloc (ir->val, ir->size * sizeof (int));
+  ir->lineno = (int *) bfrealloc (ir->lineno, ir->size * sizeof (int));
+  ir->match = (int *) bfrealloc (ir->match, ir->size * sizeof (int));
+  ir_account (ir->size * IR_SLOT, old);
+}
 
-	default:
-	  /* Extra instruction type, loop no good. */
-	  badloop = 1;
-	  break;
-	}
+/* Append an instruction and return its index. */
+int ir_add (ir_t * ir, int inst, int dst, int src, int lineno)
+{
+  ir_grow (ir, 1);
+  int i = ir->count++;
+  ir->inst[i] = inst;
+  ir->dst[i] = dst;
+  ir->src[i] = src;
+  ir->src2[i] = 0;
+  ir->val[i] = 0;
+  ir->lineno[i] = lineno;
+  ir->match[i] = -1;
+  return i;
+}
+
+/* Append a copy of instruction i of another program. Bracket matches
+   are fixed up by ir_link (). */
+void ir_copy (ir_t * out, ir_t * in, int i)
+{
+  int j = ir_add (out, in->inst[i], in->dst[i], in->src[i], in->lineno[i]);
+  out->src2[j] = in->src2[i];
+  out->val[j] = in->val[i];
+  if (in->com_count > 0)
+    ir_comment_copy (out, j, in, i);
+}
 
-      ii = ii->next;
+/* Attach comment text to instruction i, which must come after any
+   instruction already holding a comment. */
+void ir_comment_add (ir_t * ir, int i, const char *text, size_t len)
+{
+  size_t old = ir->com_size * sizeof (ir_com_t) + ir->com_text_size;
+  if (ir->com_count == ir->com_size)
+    {
+      ir->com_size = ir->com_size ? ir->com_size * 2 : 64;
+      ir->com = (ir_com_t *) bfrealloc (ir->com,
+					ir->com_size * sizeof (ir_com_t));
+    }
+  if (ir->com_text_len + len > ir->com_text_size)
+    {
+      if (ir->com_text_size == 0)
+	ir->com_text_size = 1024;
+      while (ir->com_text_len + len > ir->com_text_size)
+	ir->com_text_size *= 2;
+      ir->com_text = (char *) bfrealloc (ir->com_text, ir->com_text_size);
     }
+  ir_account (ir->com_size * sizeof (ir_com_t) + ir->com_text_size, old);
+
+  ir_com_t *com = &ir->com[ir->com_count++];
+  com->inst = i;
+  com->len = len;
+  com->off = ir->com_text_len;
+  memcpy (ir->com_text + com->off, text, len);
+  ir->com_text_len += len;
+}
 
-  if (badloop)
-    return NULL;
+/* Give instruction j of out the comment, if any, of instruction i of
+   in. */
+void ir_comment_copy (ir_t * out, int j, ir_t * in, int i)
+{
+  int lo = 0, hi = in->com_count;
+  while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (in->com[mid].inst < i)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (lo < in->com_count && in->com[lo].inst == i)
+    ir_comment_add (out, j, in->com_text + in->com[lo].off, in->com[lo].len);
+}
 
-  if (bal != 0)
+/* Recompute the bracket matches. */
+void ir_link (ir_t * ir)
+{
+  int depth = 0, i;
+  int *stack = (int *) bfmalloc ((ir->count + 1) * sizeof (int));
+  for (i = 0; i < ir->count; i++)
     {
-      /* Unbalanced */
-      return NULL;
+      if (ir->inst[i] == IM_LOOP)
+	stack[depth++] = i;
+      else if (ir->inst[i] == IM_END)
+	{
+	  int open = stack[--depth];
+	  ir->match[open] = i;
+	  ir->match[i] = open;
+	}
     }
+  free (stack);
+}
 
-  /* Clear and link */
-  newinst.inst = IM_CCLR;
-  newinst.ret = loopinst->ret->ret;
-  tail->next = im_create (&newinst);
-  tail = tail->next;
-  tail->next = loopinst->ret->next;
-  if (tail->next == NULL)
-    tail->next = loopinst->ret->ret;
+void ir_free (ir_t * ir)
+{
+  ir_account (0, ir->size * IR_SLOT + ir->com_size * sizeof (ir_com_t)
+	      + ir->com_text_size);
+  free (ir->inst);
+  free (ir->dst);
+  free (ir->src);
+  free (ir->src2);
+  free (ir->val);
+  free (ir->lineno);
+  free (ir->match);
+  free (ir->com);
+  free (ir->com_text);
+  memset (ir, 0, sizeof (ir_t));
+}
 
-  return head->next;
+/* Peak bytes held by instructions and comments */
+size_t ir_peak ()
+{
+  return ir_high;
 }
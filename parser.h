@@ -1,18 +1,41 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-/* Intermediate code structure. */
-typedef struct inst_t
+#include <stdio.h>
+#include "common.h"
+
+/* A comment: a span of comment text attached to an instruction */
+typedef struct ir_com_t
+{
+  int inst;			/* Instruction it precedes */
+  int len;			/* Length of text */
+  size_t off;			/* Offset of text in com_text */
+} ir_com_t;
+
+/* Intermediate code. Instructions are stored flat in program order,
+   one array per field. Loops are bracketed by IM_LOOP and IM_END,
+   and each bracket's match entry holds the index of the other.
+   Comments, only kept for --comments, are a side table sorted by
+   instruction. */
+typedef struct ir_t
 {
-  int inst;
-  int dst;
-  int src;
-  int lineno;
-  char *comment;
-  struct inst_t *loop;
-  struct inst_t *ret;
-  struct inst_t *next;
-} inst_t;
+  int count;			/* Number of instructions */
+  int size;			/* Allocated slots */
+  unsigned char *inst;		/* Instruction codes */
+  int *dst;			/* Destination cell offset */
+  int *src;			/* Source cell offset, or repeat count */
+  int *src2;			/* Second source cell offset */
+  int *val;			/* Constant operand */
+  int *lineno;			/* Source line */
+  int *match;			/* Matching bracket index */
+
+  ir_com_t *com;		/* Comment table */
+  int com_count;		/* Number of comments */
+  int com_size;			/* Allocated table entries */
+  char *com_text;		/* Text of all comments */
+  size_t com_text_len;		/* Bytes used in com_text */
+  size_t com_text_size;		/* Bytes allocated for com_text */
+} ir_t;
 
 /* Intermediate instruction codes */
 #define IM_NOP   0		/* No operation */
@@ -22,21 +45,88 @@ typedef struct inst_t
 #define IM_OUT   4		/* Output */
 #define IM_PRGHT 5		/* Move pointer right */
 #define IM_PLEFT 6		/* Move pointer left */
+#define IM_CMUL  7		/* Cell multiply-add, dst += src * val */
 #define IM_CADD  8		/* Cell adding */
 #define IM_CCLR  9		/* Clear cell */
+#define IM_LOOP  10		/* Loop beginning */
+#define IM_END   11		/* Loop ending */
+#define IM_SCAN  12		/* Step by src until a zero cell */
+#define IM_CSET  13		/* Set cell to val */
+#define IM_COUT  14		/* Output the byte val */
+#define IM_CPROD 15		/* Cell product-add, dst += src * src2 * val */
+
+/* Parser state. Each input program gets its own, so programs can be
+   parsed independently. */
+typedef struct parser_t
+{
+  ir_t ir;			/* Parsed program */
+  int lineno;			/* Current scanner line number */
+
+  /* Run-length mode for +-<> */
+  char mode;
+  int mode_count;
 
-extern inst_t *head;		/* First instruction */
-extern inst_t *tail;		/* Last instruction */
+  /* Open loops */
+  int *loop_stack;
+  int loop_depth;
+  int loop_size;
+  int loop_bad;			/* Saw an unmatched ] */
+
+  /* Pending comment */
+  char *com_buf;
+  char *com_ptr;
+  size_t com_buf_size;
+
+  /* Scanner input */
+  FILE *in;			/* Input stream */
+  char *scan_block;		/* Read buffer */
+  char *scan_buf;		/* Current block of source */
+  size_t scan_len;		/* Bytes in current block */
+  size_t scan_pos;		/* Scan position in current block */
+  int scan_mapped;		/* Block is the whole file, mapped */
+  int scan_lineinc;		/* Newlines since the last command */
+
+  /* Streaming: when set, called with each finished top-level region
+     of the program. The callee consumes and empties ir. */
+  void (*region) (struct parser_t * p);
+} parser_t;
+
+/* Top-level straight-line code is also handed off in chunks of at
+   most this many instructions. */
+#define REGION_MAX 65536
+
+/* Instruction storage */
+int ir_add (ir_t * ir, int inst, int dst, int src, int lineno);
+void ir_copy (ir_t * out, ir_t * in, int i);
+void ir_comment_add (ir_t * ir, int i, const char *text, size_t len);
+void ir_comment_copy (ir_t * out, int j, ir_t * in, int i);
+void ir_link (ir_t * ir);
+void ir_free (ir_t * ir);
+size_t ir_peak ();
 
 #include "codegen.h"
 
-char bfscan ();
-void bfparse (char c);
+void parser_init (parser_t * p);
+void parser_free (parser_t * p);
+void bfscan_open (parser_t * p, FILE * in);
+void bfscan_close (parser_t * p);
+size_t bfscan (parser_t * p, char **run);
+void bfparse (parser_t * p, char c);
+int bfparse_depth (parser_t * p);
 
 /* Optimization */
-void im_opt (inst_t * head);
-inst_t *loop_add_opt (inst_t * loopinst);
-
-extern int lineno;
+extern int opt_rounds;		/* Most rounds of all passes */
+extern int opt_stats;		/* Report per-pass statistics */
+void im_opt (ir_t * ir, int start);
+int opt_set (char *name);
+void opt_list (FILE * out);
+void opt_print_stats (FILE * out);
+int loop_add_opt (ir_t * out, ir_t * in, int loop);
+int loop_scan_opt (ir_t * out, ir_t * in, int loop);
+int loop_nest_opt (ir_t * out, ir_t * in, int loop);
+void move_sink_opt (ir_t * ir);
+void const_opt (ir_t * ir, int start);
+void set_fuse_opt (ir_t * ir);
+void im_eval (ir_t * ir, long steps);
 
 #endif
@@ -0,0 +1,321 @@
+#include "common.h"
+#include "parser.h"
+#include "codegen.h"
+#include "x86.h"
+
+#include <string.h>
+
+/* Registers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+
+/* Opcodes for cell operations on 1, 2 and 4 byte cells, indexed by
+   cell size / 2. A 0x66 prefix makes the 4 byte forms work on 2. */
+static const unsigned char op_addi[3] = { 0x80, 0x81, 0x81 };	/* /0 */
+static const unsigned char op_movi[3] = { 0xc6, 0xc7, 0xc7 };	/* /0 */
+static const unsigned char op_store[3] = { 0x88, 0x89, 0x89 };
+static const unsigned char op_addr[3] = { 0x00, 0x01, 0x01 };
+
+/* Append bytes */
+void x86_emit (x86_t * x, const void *b, size_t n)
+{
+  if (x->len + n > x->size)
+    {
+      while (x->len + n > x->size)
+	x->size = x->size ? x->size * 2 : 4096;
+      x->code = (unsigned char *) bfrealloc (x->code, x->size);
+    }
+  memcpy (x->code + x->len, b, n);
+  x->len += n;
+}
+
+void x86_byte (x86_t * x, int b)
+{
+  unsigned char c = b;
+  x86_emit (x, &c, 1);
+}
+
+/* Append a little-endian value of n bytes */
+void x86_imm (x86_t * x, unsigned v, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    x86_byte (x, v >> (8 * i));
+}
+
+/* Point the rel32 jump ending at offset at to target */
+void x86_patch (x86_t * x, size_t at, size_t target)
+{
+  unsigned rel = (unsigned) (target - at);
+  memcpy (x->code + at - 4, &rel, 4);
+}
+
+/* Emit opcode op, with a 0x66 prefix for 2 byte cells, addressing
+   cell off with reg as the ModRM register field. */
+static void x86_cell (x86_t * x, int op, int reg, int off)
+{
+  if (x->cell == 2)
+    x86_byte (x, 0x66);
+  x86_byte (x, op);
+  x86_byte (x, 0x80 | reg << 3 | RBX);
+  x86_imm (x, off * x->cell, 4);
+}
+
+/* Load cell off, zero extended, into reg */
+static void x86_load (x86_t * x, int reg, int off)
+{
+  if (x->cell == 4)
+    x86_byte (x, 0x8b);
+  else
+    {
+      x86_byte (x, 0x0f);
+      x86_byte (x, x->cell == 1 ? 0xb6 : 0xb7);
+    }
+  x86_byte (x, 0x80 | reg << 3 | RBX);
+  x86_imm (x, off * x->cell, 4);
+}
+
+/* cmp cell 0, 0 */
+static void x86_test (x86_t * x)
+{
+  x86_cell (x, x->cell == 1 ? 0x80 : 0x83, 7, 0);
+  x86_byte (x, 0);
+}
+
+/* Call runtime entry point fn, with the context as first argument */
+static void x86_call (x86_t * x, int fn)
+{
+  static const unsigned char ctx[] = { 0x4c, 0x89, 0xef };	/* rdi = r13 */
+  x86_emit (x, ctx, sizeof (ctx));
+  x86_byte (x, 0x41);		/* call [r13 + 8 * fn] */
+  x86_byte (x, 0xff);
+  x86_byte (x, 0x55);
+  x86_byte (x, 8 * fn);
+}
+
+/* Take a new pointer from rax, and the buffer from the context */
+static void x86_reload (x86_t * x)
+{
+  static const unsigned char code[] = {
+    0x48, 0x89, 0xc3,		/* mov rbx, rax */
+    0x4d, 0x8b, 0x65, X86_BASE,	/* mov r12, [r13 + X86_BASE] */
+    0x4d, 0x8b, 0x75, X86_END	/* mov r14, [r13 + X86_END] */
+  };
+  x86_emit (x, code, sizeof (code));
+}
+
+/* Jump past a failed check when the address of cell off compares as
+   cond with the buffer end (r14) or start (r12). Returns the offset
+   of the jump, for x86_patch (). */
+static size_t x86_check (x86_t * x, int off, int end, int cond)
+{
+  x86_byte (x, 0x48);		/* lea rax, [rbx + off] */
+  x86_byte (x, 0x8d);
+  x86_byte (x, 0x83);
+  x86_imm (x, off * x->cell, 4);
+  x86_byte (x, 0x4c);		/* cmp rax, r14 or r12 */
+  x86_byte (x, 0x39);
+  x86_byte (x, end ? 0xf0 : 0xe0);
+  x86_byte (x, 0x0f);		/* jcc rel32 */
+  x86_byte (x, cond);
+  x86_imm (x, 0, 4);
+  return x->len;
+}
+
+/* Report the line when a bounds check fails */
+static void x86_bounderr (x86_t * x, int line)
+{
+  x86_byte (x, 0xbe);		/* mov esi, line */
+  x86_imm (x, line, 4);
+  x86_call (x, X86_BOUNDS);
+}
+
+/* Checks covering every cell the block of straight-line code at i
+   touches */
+static void x86_block (x86_t * x, ir_t * ir, int i)
+{
+  int lo, hi, move;
+  size_t j;
+  if (!dynamic_mem && !check_bounds)
+    return;
+
+  block_reach (ir, i, &lo, &hi, &move);
+  if (hi > 0 && dynamic_mem)
+    {
+      j = x86_check (x, hi, 1, 0x82);	/* jb */
+      x86_byte (x, 0x48);	/* mov rsi, rbx */
+      x86_byte (x, 0x89);
+      x86_byte (x, 0xde);
+      x86_byte (x, 0xba);	/* mov edx, hi */
+      x86_imm (x, hi, 4);
+      x86_call (x, X86_GROW);
+      x86_reload (x);
+      x86_patch (x, j, x->len);
+    }
+  else if (hi > 0 && check_bounds)
+    {
+      j = x86_check (x, hi, 1, 0x82);	/* jb */
+      x86_bounderr (x, ir->lineno[i]);
+      x86_patch (x, j, x->len);
+    }
+  if (lo < 0 && check_bounds)
+    {
+      j = x86_check (x, lo, 0, 0x83);	/* jae */
+      x86_bounderr (x, ir->lineno[i]);
+      x86_patch (x, j, x->len);
+    }
+}
+
+/* Emit code for one instruction */
+static void x86_inst (x86_t * x, ir_t * ir, int i)
+{
+  int z = x->cell / 2;
+  unsigned k;
+  size_t j;
+
+  switch (ir->inst[i])
+    {
+    case IM_CINC:
+    case IM_CDEC:
+      x86_cell (x, op_addi[z], 0, ir->dst[i]);
+      k = ir->inst[i] == IM_CINC ? ir->src[i] : -(unsigned) ir->src[i];
+      x86_imm (x, k, x->cell);
+      break;
+
+    case IM_PRGHT:
+    case IM_PLEFT:
+      x86_byte (x, 0x48);	/* add rbx, imm32 */
+      x86_byte (x, 0x81);
+      x86_byte (x, 0xc3);
+      k = ir->src[i] * x->cell;
+      x86_imm (x, ir->inst[i] == IM_PRGHT ? k : -k, 4);
+      break;
+
+    case IM_CSET:
+    case IM_CCLR:
+      x86_cell (x, op_movi[z], 0, ir->dst[i]);
+      x86_imm (x, ir->inst[i] == IM_CSET ? ir->val[i] : 0, x->cell);
+      break;
+
+    case IM_CADD:
+    case IM_CMUL:
+    case IM_CPROD:
+      x86_load (x, RAX, ir->src[i]);
+      if (ir->inst[i] == IM_CPROD)
+	{
+	  x86_load (x, RCX, ir->src2[i]);
+	  x86_byte (x, 0x0f);	/* imul eax, ecx */
+	  x86_byte (x, 0xaf);
+	  x86_byte (x, 0xc1);
+	}
+      if (ir->inst[i] != IM_CADD && ir->val[i] != 1)
+	{
+	  x86_byte (x, 0x69);	/* imul eax, eax, val */
+	  x86_byte (x, 0xc0);
+	  x86_imm (x, ir->val[i], 4);
+	}
+      x86_cell (x, op_addr[z], RAX, ir->dst[i]);
+      break;
+
+    case IM_IN:
+      x86_call (x, X86_GETC);
+      x86_cell (x, op_store[z], RAX, ir->dst[i]);
+      break;
+
+    case IM_OUT:
+      x86_load (x, RSI, ir->dst[i]);
+      x86_call (x, X86_PUTC);
+      break;
+
+    case IM_COUT:
+      x86_byte (x, 0xbe);	/* mov esi, val */
+      x86_imm (x, ir->val[i] & 0xff, 4);
+      x86_call (x, X86_PUTC);
+      break;
+
+    case IM_LOOP:
+      x86_test (x);
+      x86_byte (x, 0x0f);	/* je rel32, patched at the end */
+      x86_byte (x, 0x84);
+      x86_imm (x, 0, 4);
+      if (x->loop_depth == x->loop_size)
+	{
+	  x->loop_size = x->loop_size ? x->loop_size * 2 : 64;
+	  x->loop = (size_t *) bfrealloc (x->loop,
+					  x->loop_size * sizeof (size_t));
+	}
+      x->loop[x->loop_depth++] = x->len;
+      break;
+
+    case IM_END:
+      j = x->loop[--x->loop_depth];
+      x86_test (x);
+      x86_byte (x, 0x0f);	/* jne rel32 */
+      x86_byte (x, 0x85);
+      x86_imm (x, 0, 4);
+      x86_patch (x, x->len, j);
+      x86_patch (x, j, x->len);
+      break;
+
+    case IM_SCAN:
+      x86_byte (x, 0x48);	/* mov rsi, rbx */
+      x86_byte (x, 0x89);
+      x86_byte (x, 0xde);
+      x86_byte (x, 0xba);	/* mov edx, n */
+      x86_imm (x, ir->src[i], 4);
+      x86_byte (x, 0xb9);	/* mov ecx, line */
+      x86_imm (x, ir->lineno[i], 4);
+      x86_call (x, X86_SCAN);
+      x86_reload (x);
+      break;
+    }
+}
+
+/* Generate machine code for a whole program. */
+void x86_program (x86_t * x, ir_t * ir)
+{
+  static const unsigned char head[] = {
+    0x53,			/* push rbx */
+    0x41, 0x54,			/* push r12 */
+    0x41, 0x55,			/* push r13 */
+    0x41, 0x56,			/* push r14 */
+    0x41, 0x57,			/* push r15, keeps the stack aligned */
+    0x49, 0x89, 0xfd,		/* mov r13, rdi */
+    0x48, 0x89, 0xf3,		/* mov rbx, rsi */
+    0x4d, 0x8b, 0x65, X86_BASE,	/* mov r12, [r13 + X86_BASE] */
+    0x4d, 0x8b, 0x75, X86_END	/* mov r14, [r13 + X86_END] */
+  };
+  static const unsigned char tail[] = {
+    0x41, 0x5f,			/* pop r15 */
+    0x41, 0x5e,			/* pop r14 */
+    0x41, 0x5d,			/* pop r13 */
+    0x41, 0x5c,			/* pop r12 */
+    0x5b,			/* pop rbx */
+    0xc3			/* ret */
+  };
+  int i;
+
+  x->cell = cell_bits / 8;
+  x86_emit (x, head, sizeof (head));
+  for (i = 0; i < ir->count; i++)
+    {
+      /* Entering straight-line code */
+      if ((i == 0 || ir->inst[i - 1] == IM_LOOP
+	   || ir->inst[i - 1] == IM_END || ir->inst[i - 1] == IM_SCAN)
+	  && ir->inst[i] != IM_LOOP && ir->inst[i] != IM_END
+	  && ir->inst[i] != IM_SCAN)
+	x86_block (x, ir, i);
+      x86_inst (x, ir, i);
+    }
+  x86_emit (x, tail, sizeof (tail));
+}
+
+void x86_free (x86_t * x)
+{
+  free (x->code);
+  free (x->loop);
+  memset (x, 0, sizeof (x86_t));
+}
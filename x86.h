@@ -0,0 +1,47 @@
+#ifndef X86_H
+#define X86_H
+
+#include <stddef.h>
+#include "parser.h"
+
+/* x86-64 machine code for a program. The code is one function,
+   called with the runtime context in rdi and the buffer in rsi. The
+   pointer lives in rbx, the context in r13, and the buffer's start
+   and end in r12 and r14. */
+typedef struct x86_t
+{
+  unsigned char *code;		/* Machine code */
+  size_t len;			/* Bytes used */
+  size_t size;			/* Bytes allocated */
+  int cell;			/* Bytes per cell */
+
+  /* Open loops: offsets of their exit jumps */
+  size_t *loop;
+  int loop_depth;
+  int loop_size;
+} x86_t;
+
+/* Runtime entry points, called through the table at the start of
+   the context with the System V calling convention. */
+#define X86_GETC   0		/* int getc (ctx) */
+#define X86_PUTC   1		/* void putc (ctx, int c) */
+#define X86_GROW   2		/* void *grow (ctx, void *ptr, int need) */
+#define X86_BOUNDS 3		/* void bounds (ctx, int line), no return */
+#define X86_SCAN   4		/* void *scan (ctx, void *ptr, int n, int line) */
+#define X86_FUNCS  5
+
+/* Context offsets of the buffer's start and end, which grow () and
+   scan () keep up to date */
+#define X86_BASE (X86_FUNCS * 8)
+#define X86_END  (X86_BASE + 8)
+
+void x86_program (x86_t * x, ir_t * ir);
+void x86_free (x86_t * x);
+
+/* Encoding, for code of other writers around a program's */
+void x86_emit (x86_t * x, const void *b, size_t n);
+void x86_byte (x86_t * x, int b);
+void x86_imm (x86_t * x, unsigned v, int n);	/* Little-endian */
+void x86_patch (x86_t * x, size_t at, size_t target);	/* rel32 */
+
+#endif